@@ -0,0 +1,541 @@
+/*
+ *  xmalloc benchmarks, each prints one line per measurement
+ *
+ *  gcc -O2 -pthread -o bench/bench bench/bench.c -lm
+ *  ./bench/bench [scenario] [threads] > bench_output.txt
+ *
+ *  scenarios are all (the default), threads (locks and caches at 32
+ *  threads or the given number), random (span pops in order against
+ *  XMALLOC_HARDEN_RANDOM), copy (memcpy against the non temporal xrealloc
+ *  copies), sized (xfree against the sized frees), colors (spans without
+ *  and with cache colors) and reuse (bursts reusing freed slots)
+ *
+ *  the allocator is included rather than linked so a scenario can reach
+ *  its internals, runtime switches (XMALLOC_PERCPU=0,
+ *  XMALLOC_OWNED_SPANS=1, XMALLOC_HARDENED=2) apply as usual
+ */
+
+#include "../xmalloc.c"
+
+#include <math.h>
+#include <sys/resource.h>
+
+
+
+// --------- BENCHMARK HELPERS --------------------------------------
+
+
+
+// the number of threads of the threaded scenarios, 32 by default so the
+// arena and transfer cache locks are contended
+static int g_Threads = 32;
+
+// the operations each thread of a threaded scenario does
+static long g_Iterations = 1000000;
+
+// gets the monotonic clock in nanoseconds
+static double now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+// gets the cpu time of the process in nanoseconds, user and system
+static double cpu_ns(void) {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e9 + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e3;
+}
+
+// gets the number of times the threads of the process blocked, such as
+// parking on a lock's futex
+static double blocks(void) {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_nvcsw;
+}
+
+// runs a thread function on g_Threads threads and prints the wall time,
+// cpu time and blocks per thousand operations over all threads
+static void run_threads(const char* name, void* (*thread)(void*)) {
+    pthread_t threads[256];
+    int threads_num = g_Threads < 256 ? g_Threads : 256;
+    double start = now_ns();
+    double start_cpu = cpu_ns();
+    double start_blocks = blocks();
+    double ops = (double)g_Iterations * threads_num;
+    int i;
+
+    for (i = 0; i < threads_num; i++) {
+        pthread_create(&threads[i], 0, thread, (void*)(uintptr_t)i);
+    }
+    for (i = 0; i < threads_num; i++) {
+        pthread_join(threads[i], 0);
+    }
+
+    printf("%-10s %3d threads: %7.1f ns/op wall, %7.1f ns/op cpu, %6.2f blocks/1000 ops\n", name, threads_num, (now_ns() - start) / ops, (cpu_ns() - start_cpu) / ops, (blocks() - start_blocks) * 1000 / ops);
+}
+
+
+
+// --------- THREADED SCENARIOS -------------------------------------
+
+
+
+// xmallocs and xfrees one small object at a time, served by the caches
+static void* tight_thread(void* arg) {
+    (void)arg;
+
+    for (long i = 0; i < g_Iterations; i++) {
+        void* ptr = xmalloc(32);
+        *(volatile char*)ptr = 1;
+        xfree(ptr);
+    }
+    return 0;
+}
+
+// replaces random objects of 8 to 256 bytes in a window of 64
+static void* churn_thread(void* arg) {
+    uint32_t seed = (uint32_t)(uintptr_t)arg + 1;
+    void* window[64] = { 0 };
+
+    for (long i = 0; i < g_Iterations; i++) {
+        seed = seed * 1103515245 + 12345;
+        int slot = (seed >> 8) & 63;
+        xfree(window[slot]);
+        window[slot] = xmalloc(8 + (seed >> 16) % 248);
+    }
+    for (int slot = 0; slot < 64; slot++) {
+        xfree(window[slot]);
+    }
+    return 0;
+}
+
+// xmallocs bursts of 1024 objects of one size before xfreeing them,
+// more than a cache holds, so every burst refills from and flushes to
+// the transfer caches and arena stacks under their locks
+static void* burst_thread(void* arg) {
+    size_t size = 64 << ((uintptr_t)arg % 3);
+    void* burst[1024];
+    long i = 0;
+
+    while (i < g_Iterations) {
+        for (int j = 0; j < 1024; j++, i++) {
+            burst[j] = xmalloc(size);
+            *(volatile char*)burst[j] = 1;
+        }
+        for (int j = 0; j < 1024; j++) {
+            xfree(burst[j]);
+        }
+    }
+    return 0;
+}
+
+// the ring of objects passed from producer to consumer threads, one
+// ring per pair
+#define RING_SIZE 4096
+
+typedef struct object_ring {
+    void* objects[RING_SIZE];
+    long head;
+    long tail;
+} object_ring;
+
+static object_ring* g_Rings;
+
+// xmallocs objects into its pair's ring
+static void* producer_thread(void* arg) {
+    object_ring* ring = &g_Rings[(uintptr_t)arg / 2];
+
+    for (long i = 0; i < g_Iterations; i++) {
+        void* ptr = xmalloc(48);
+        while (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= RING_SIZE) {
+            sched_yield();
+        }
+        ring->objects[ring->head % RING_SIZE] = ptr;
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+// xfrees the objects of its pair's ring, so every object is freed by a
+// thread other than the one that xmalloced it
+static void* consumer_thread(void* arg) {
+    object_ring* ring = &g_Rings[(uintptr_t)arg / 2];
+
+    for (long i = 0; i < g_Iterations; i++) {
+        while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail) {
+            sched_yield();
+        }
+        xfree(ring->objects[ring->tail % RING_SIZE]);
+        __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+// even threads produce and odd threads consume
+static void* prodcons_thread(void* arg) {
+    return (uintptr_t)arg % 2 ? consumer_thread(arg) : producer_thread(arg);
+}
+
+// runs the threaded scenarios
+static void bench_threads(void) {
+    g_Rings = calloc(g_Threads / 2 + 1, sizeof(object_ring));
+
+    run_threads("tight", tight_thread);
+    run_threads("churn", churn_thread);
+    run_threads("burst", burst_thread);
+    run_threads("prodcons", prodcons_thread);
+
+    free(g_Rings);
+}
+
+
+
+// --------- RANDOMIZED POP SCENARIOS -------------------------------
+
+
+
+// runs the threaded scenarios with span pops in order and then with
+// XMALLOC_HARDEN_RANDOM, hardened free checks are left as they are
+static void bench_random(void) {
+    int flags = g_Hardened & XMALLOC_HARDEN_FREE;
+
+    printf("pops in order\n");
+    xmalloc_set_hardened(flags);
+    bench_threads();
+
+    printf("pops randomized\n");
+    xmalloc_set_hardened(flags | XMALLOC_HARDEN_RANDOM);
+    bench_threads();
+
+    xmalloc_set_hardened(flags);
+}
+
+
+
+// --------- COPY SCENARIOS -----------------------------------------
+
+
+
+// the largest copy and a working set re-read after each copy
+#define COPY_MAX ((size_t)256 << 20)
+#define WORKING_SET ((size_t)1 << 20)
+
+static char g_Working_Set[WORKING_SET];
+
+// prints the throughput of a copy function for one size in GB/s and
+// the microseconds to re-read the working set after it, best of three
+static void bench_copy_size(void (*copy)(void*, const void*, size_t), void* dst, const void* src, size_t size) {
+    int reps = (int)(((size_t)1 << 30) / size);
+    double best = 1e18;
+    double reread = 1e18;
+    double start;
+    double elapsed;
+    volatile long sum = 0;
+
+    reps = reps < 2 ? 2 : reps > 20000 ? 20000 : reps;
+    for (int k = 0; k < 3; k++) {
+        memset(g_Working_Set, k, sizeof(g_Working_Set));
+
+        start = now_ns();
+        for (int r = 0; r < reps; r++) {
+            copy(dst, src, size);
+        }
+        elapsed = (now_ns() - start) / reps;
+        best = elapsed < best ? elapsed : best;
+
+        start = now_ns();
+        for (size_t i = 0; i < sizeof(g_Working_Set); i += 64) {
+            sum += g_Working_Set[i];
+        }
+        elapsed = now_ns() - start;
+        reread = elapsed < reread ? elapsed : reread;
+    }
+
+    printf(" %8.2f %7.1f", size / best, reread / 1e3);
+}
+
+// memcpy with the signature of the non temporal copies
+static void plain_copy(void* dst, const void* src, size_t size) {
+    memcpy(dst, src, size);
+}
+
+// compares memcpy with the non temporal copies the cpu supports, the
+// copies xrealloc makes of c_Stream_Copy_Min bytes or more
+static void bench_copy(void) {
+    void (*copies[4])(void*, const void*, size_t) = { plain_copy };
+    const char* names[4] = { "memcpy" };
+    int copies_num = 1;
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    copies[copies_num] = stream_copy_sse2;
+    names[copies_num++] = "sse2";
+    if (__builtin_cpu_supports("avx2")) {
+        copies[copies_num] = stream_copy_avx2;
+        names[copies_num++] = "avx2";
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        copies[copies_num] = stream_copy_avx512;
+        names[copies_num++] = "avx512";
+    }
+#endif
+
+    char* src = mmap(0, COPY_MAX, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    char* dst = mmap(0, COPY_MAX, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (src == MAP_FAILED || dst == MAP_FAILED) {
+        return;
+    }
+    memset(src, 1, COPY_MAX);
+    memset(dst, 2, COPY_MAX);
+
+    printf("copy size ");
+    for (int f = 0; f < copies_num; f++) {
+        printf(" %7s GB/s reread us", names[f]);
+    }
+    printf("\n");
+
+    for (size_t size = 16384; size <= COPY_MAX; size *= 4) {
+        printf("%9zu ", size);
+        for (int f = 0; f < copies_num; f++) {
+            bench_copy_size(copies[f], dst, src, size);
+        }
+        printf("\n");
+    }
+
+    munmap(src, COPY_MAX);
+    munmap(dst, COPY_MAX);
+}
+
+
+
+// --------- SIZED FREE SCENARIOS -----------------------------------
+
+
+
+// xmallocs 512 objects of 1 to 1000 bytes and frees them with xfree,
+// xfree_sized and xmalloc_aligned with xfree_aligned_sized, prints the
+// best of 9 runs of 20000 rounds in ms
+static void bench_sized(void) {
+    static void* objects[512];
+    static size_t sizes[512];
+    double best[3] = { 1e18, 1e18, 1e18 };
+    double start;
+    uint32_t seed = 1;
+    int i;
+
+    for (i = 0; i < 512; i++) {
+        seed = seed * 1103515245 + 12345;
+        sizes[i] = (seed >> 16) % 1000 + 1;
+    }
+
+    for (int rep = 0; rep < 9; rep++) {
+        start = now_ns();
+        for (int r = 0; r < 20000; r++) {
+            for (i = 0; i < 512; i++) {
+                objects[i] = xmalloc(sizes[i]);
+            }
+            for (i = 0; i < 512; i++) {
+                xfree(objects[i]);
+            }
+        }
+        best[0] = fmin(best[0], now_ns() - start);
+
+        start = now_ns();
+        for (int r = 0; r < 20000; r++) {
+            for (i = 0; i < 512; i++) {
+                objects[i] = xmalloc(sizes[i]);
+            }
+            for (i = 0; i < 512; i++) {
+                xfree_sized(objects[i], sizes[i]);
+            }
+        }
+        best[1] = fmin(best[1], now_ns() - start);
+
+        start = now_ns();
+        for (int r = 0; r < 20000; r++) {
+            for (i = 0; i < 512; i++) {
+                objects[i] = xmalloc_aligned(8, sizes[i]);
+            }
+            for (i = 0; i < 512; i++) {
+                xfree_aligned_sized(objects[i], 8, sizes[i]);
+            }
+        }
+        best[2] = fmin(best[2], now_ns() - start);
+    }
+
+    printf("xfree %.0f ms, xfree_sized %.0f ms, xfree_aligned_sized %.0f ms\n", best[0] / 1e6, best[1] / 1e6, best[2] / 1e6);
+}
+
+
+
+// --------- CACHE COLOR SCENARIOS ----------------------------------
+
+
+
+// touches the first slot of a number of spans of a bucket size in turn
+// and prints the best of 7 runs in ns per access, the spans are new so
+// they are colored as the bucket currently colors spans
+static void bench_color_spans(size_t size, int spans_num) {
+    static uint64_t* objects[4096];
+    static void* taken[1 << 16];
+    int taken_num = 0;
+    int objects_num = 0;
+    uint64_t header = 0;
+    uint64_t sum = 0;
+    double best = 1e18;
+    double start;
+
+    // xmalloc until enough spans were started, keeping the first slot
+    // handed out from each
+    while (objects_num < spans_num && taken_num < (1 << 16)) {
+        uint64_t* ptr = xmalloc(size);
+        taken[taken_num++] = ptr;
+        if (get_page_map(ptr) != header) {
+            header = get_page_map(ptr);
+            objects[objects_num++] = ptr;
+        }
+    }
+
+    for (int r = 0; r < 7; r++) {
+        start = now_ns();
+        for (int it = 0; it < 20000; it++) {
+            for (int i = 0; i < objects_num; i++) {
+                sum += objects[i][0];
+                objects[i][0] = sum;
+            }
+        }
+        best = fmin(best, (now_ns() - start) / (20000.0 * objects_num));
+    }
+
+    printf(" %6.2f", best + (sum == 42));
+
+    // free the spans so the next run starts new ones
+    while (taken_num) {
+        xfree(taken[--taken_num]);
+    }
+    xmalloc_purge();
+}
+
+// compares touching equally placed slots of many spans with the spans
+// uncolored and colored, power of two buckets past a cache line keep
+// their slots alligned instead of colored so the sizes are the others
+static void bench_colors(void) {
+    static const size_t sizes[4] = { 384, 1536, 3072, 6144 };
+    static const int spans[4] = { 16, 64, 128, 256 };
+    uint32_t colors[BUCKET_NUM];
+
+    memcpy(colors, g_Bucket_Colors, sizeof(colors));
+
+    printf("ns/access  spans");
+    for (int s = 0; s < 4; s++) {
+        printf(" %6d", spans[s]);
+    }
+    printf("\n");
+
+    for (int z = 0; z < 4; z++) {
+        for (int colored = 0; colored < 2; colored++) {
+            for (int bucket_i = 0; bucket_i < BUCKET_NUM; bucket_i++) {
+                g_Bucket_Colors[bucket_i] = colored ? colors[bucket_i] : 1;
+            }
+
+            printf("%5zu B %-8s", sizes[z], colored ? "colored" : "plain");
+            for (int s = 0; s < 4; s++) {
+                bench_color_spans(sizes[z], spans[s]);
+            }
+            printf("\n");
+        }
+    }
+}
+
+
+
+// --------- SLOT REUSE SCENARIOS -----------------------------------
+
+
+
+// xmallocs bursts of objects, writes them and xfrees them, prints the
+// best of 5 runs in ns per object and the distinct slots the first 50
+// bursts touched
+static void bench_reuse_burst(size_t size, int burst_num) {
+    static void* objects[4096];
+    static void* seen[1 << 14];
+    int seen_num = 0;
+    double best = 1e18;
+    double start;
+    int i;
+    int k;
+
+    for (int r = 0; r < 5; r++) {
+        start = now_ns();
+        for (int it = 0; it < 5000; it++) {
+            for (i = 0; i < burst_num; i++) {
+                objects[i] = xmalloc(size);
+                memset(objects[i], i, size);
+            }
+            for (i = 0; r == 0 && it < 50 && i < burst_num; i++) {
+                for (k = 0; k < seen_num && seen[k] != objects[i]; k++);
+                if (k == seen_num && seen_num < (1 << 14)) {
+                    seen[seen_num++] = objects[i];
+                }
+            }
+            for (i = burst_num; i-- > 0;) {
+                xfree(objects[i]);
+            }
+        }
+        best = fmin(best, (now_ns() - start) / (5000.0 * burst_num));
+    }
+
+    printf("%5zu B burst %3d: %6.1f ns/object, %4d distinct slots\n", size, burst_num, best, seen_num);
+}
+
+// runs bursts bigger than the caches hold, so freed slots go back to
+// the spans before the next burst takes them again
+static void bench_reuse(void) {
+    bench_reuse_burst(4096, 256);
+    bench_reuse_burst(1024, 256);
+    bench_reuse_burst(8192, 16);
+    bench_reuse_burst(4096, 64);
+}
+
+
+
+// --------- MAIN ---------------------------------------------------
+
+
+
+int main(int argc, char** argv) {
+    const char* scenario = argc > 1 ? argv[1] : "all";
+
+    if (argc > 2) {
+        g_Threads = atoi(argv[2]);
+    }
+    if (g_Threads < 2) {
+        g_Threads = 2;
+    }
+
+    if (!strcmp(scenario, "all") || !strcmp(scenario, "threads")) {
+        bench_threads();
+    }
+    if (!strcmp(scenario, "all") || !strcmp(scenario, "random")) {
+        bench_random();
+    }
+    if (!strcmp(scenario, "all") || !strcmp(scenario, "copy")) {
+        bench_copy();
+    }
+    if (!strcmp(scenario, "all") || !strcmp(scenario, "sized")) {
+        bench_sized();
+    }
+    if (!strcmp(scenario, "all") || !strcmp(scenario, "colors")) {
+        bench_colors();
+    }
+    if (!strcmp(scenario, "all") || !strcmp(scenario, "reuse")) {
+        bench_reuse();
+    }
+
+    return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ *  container benchmarks of the xmalloc C++ allocators against
+ *  std::allocator, each prints the ms of std::allocator, the
+ *  xmalloc_allocator and a pmr container over xmalloc_resource()
+ *
+ *  gcc -O2 -c -o bench/xmalloc.o xmalloc.c
+ *  g++ -O2 -std=c++17 -pthread -o bench/bench_containers bench/bench_containers.cpp bench/xmalloc.o
+ *  ./bench/bench_containers >> bench_output.txt
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../xmalloc.hpp"
+
+// a pmr allocator in the form of the other allocator templates
+template <class T>
+using pmr_allocator = std::pmr::polymorphic_allocator<T>;
+
+// the number of operations of each benchmark
+static const int c_Operations = 2000000;
+
+// gets the ms since a start time
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// inserts random keys into a map of at most 50000 nodes, erasing the
+// smallest key once it is full
+template <template <class> class Allocator>
+double bench_map() {
+    std::map<uint64_t, uint64_t, std::less<uint64_t>, Allocator<std::pair<const uint64_t, uint64_t>>> map;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t seed = 1;
+
+    for (int i = 0; i < c_Operations; i++) {
+        seed = seed * 6364136223846793005ULL + 1;
+        map[seed % 100000] = i;
+        if (map.size() > 50000) {
+            map.erase(map.begin());
+        }
+    }
+    return elapsed_ms(start);
+}
+
+// inserts and erases random keys of an unordered map
+template <template <class> class Allocator>
+double bench_unordered_map() {
+    std::unordered_map<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>, Allocator<std::pair<const uint64_t, uint64_t>>> map;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t seed = 1;
+
+    for (int i = 0; i < c_Operations; i++) {
+        seed = seed * 6364136223846793005ULL + 1;
+        map[seed % 100000] = i;
+        seed = seed * 6364136223846793005ULL + 1;
+        map.erase(seed % 100000);
+    }
+    return elapsed_ms(start);
+}
+
+// grows vectors of 10000 strings of 16 to 215 characters and replaces
+// every other string
+template <template <class> class Allocator>
+double bench_vector_strings() {
+    typedef std::basic_string<char, std::char_traits<char>, Allocator<char>> string;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t seed = 1;
+
+    for (int r = 0; r < c_Operations / 10000; r++) {
+        std::vector<string, Allocator<string>> strings;
+        for (int i = 0; i < 10000; i++) {
+            seed = seed * 6364136223846793005ULL + 1;
+            strings.emplace_back((seed >> 40) % 200 + 16, 'a');
+        }
+        for (size_t i = 0; i < strings.size(); i += 2) {
+            strings[i] = string((seed >> 33) % 100 + 20, 'b');
+        }
+    }
+    return elapsed_ms(start);
+}
+
+int main() {
+    std::pmr::set_default_resource(xmalloc_resource());
+
+    for (int rep = 0; rep < 2; rep++) {
+        std::printf("map            std %5.0f ms, xmalloc_allocator %5.0f ms, pmr %5.0f ms\n",
+                    bench_map<std::allocator>(), bench_map<xmalloc_allocator>(), bench_map<pmr_allocator>());
+        std::printf("unordered_map  std %5.0f ms, xmalloc_allocator %5.0f ms, pmr %5.0f ms\n",
+                    bench_unordered_map<std::allocator>(), bench_unordered_map<xmalloc_allocator>(), bench_unordered_map<pmr_allocator>());
+        std::printf("vector<string> std %5.0f ms, xmalloc_allocator %5.0f ms, pmr %5.0f ms\n",
+                    bench_vector_strings<std::allocator>(), bench_vector_strings<xmalloc_allocator>(), bench_vector_strings<pmr_allocator>());
+    }
+    return 0;
+}
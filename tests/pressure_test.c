@@ -0,0 +1,115 @@
+/*
+ *  tests the memory pressure poll against a fake cgroup v2 directory
+ *  and that stopping the watcher does not wait out its interval
+ *
+ *  gcc -O2 -pthread -o pressure_test tests/pressure_test.c xmalloc.c
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../xmalloc.h"
+
+// fails the test with the line of the check
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "%s:%d check failed: %s\n", __FILE__, __LINE__, #cond); exit(1); } } while (0)
+
+// writes a file of the fake cgroup
+static void write_file(const char* dir, const char* name, const char* text) {
+    char path[512];
+    FILE* file;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    file = fopen(path, "w");
+    CHECK(file);
+    fputs(text, file);
+    fclose(file);
+}
+
+// removes a file of the fake cgroup
+static void remove_file(const char* dir, const char* name) {
+    char path[512];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    unlink(path);
+}
+
+// gets the monotonic clock in milliseconds
+static long now_ms(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int main(void) {
+    char dir[] = "/tmp/xmalloc_cgroup_XXXXXX";
+    void* blocks[1024];
+    long start;
+    int i;
+
+    CHECK(mkdtemp(dir));
+
+    // a missing directory is never under pressure
+    CHECK(xmalloc_pressure_poll("/nonexistent/cgroup") == 0);
+
+    // below 90% of memory.max with no stall
+    write_file(dir, "memory.current", "800\n");
+    write_file(dir, "memory.high", "max\n");
+    write_file(dir, "memory.max", "1000\n");
+    write_file(dir, "memory.pressure", "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+    CHECK(xmalloc_pressure_poll(dir) == 0);
+
+    // at 90% of memory.max it purges once, then not again while the
+    // heap has not grown
+    write_file(dir, "memory.current", "900\n");
+    CHECK(xmalloc_pressure_poll(dir) == 1);
+    CHECK(xmalloc_pressure_poll(dir) == 0);
+
+    // growing the heap by more than a chunk allows another purge
+    for (i = 0; i < 1024; i++) {
+        blocks[i] = xmalloc(4096);
+        CHECK(blocks[i]);
+    }
+    CHECK(xmalloc_pressure_poll(dir) == 1);
+    for (i = 0; i < 1024; i++) {
+        xfree(blocks[i]);
+    }
+
+    // memory.high takes precedence over memory.max
+    write_file(dir, "memory.high", "10000\n");
+    CHECK(xmalloc_pressure_poll(dir) == 0);
+
+    // the pressure ended, so the next pressure purges at once, here a
+    // PSI stall of 10%
+    write_file(dir, "memory.pressure", "some avg10=10.00 avg60=2.00 avg300=0.50 total=12345\nfull avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+    CHECK(xmalloc_pressure_poll(dir) == 1);
+    write_file(dir, "memory.pressure", "some avg10=9.99 avg60=2.00 avg300=0.50 total=12345\n");
+    CHECK(xmalloc_pressure_poll(dir) == 0);
+
+    // a watcher with a long interval stops without waiting it out
+    CHECK(xmalloc_pressure_start(dir, 10000) == 0);
+    CHECK(xmalloc_pressure_start(dir, 10000) != 0);
+    usleep(50000);
+    start = now_ms();
+    xmalloc_pressure_stop();
+    CHECK(now_ms() - start < 1000);
+
+    // and can be started again
+    CHECK(xmalloc_pressure_start(dir, 10) == 0);
+    usleep(50000);
+    xmalloc_pressure_stop();
+
+    remove_file(dir, "memory.current");
+    remove_file(dir, "memory.high");
+    remove_file(dir, "memory.max");
+    remove_file(dir, "memory.pressure");
+    rmdir(dir);
+
+    printf("pressure_test ok\n");
+    return 0;
+}
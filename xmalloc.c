@@ -4,6 +4,8 @@
  *  ch02
  */
 
+#define _GNU_SOURCE
+
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -12,6 +14,22 @@
 #include <assert.h>
 #include <pthread.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <sys/random.h>
+#include <linux/futex.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#ifndef MREMAP_DONTUNMAP
+#define MREMAP_DONTUNMAP 4
+#endif
 
 #include "xmalloc.h"
 
@@ -38,18 +56,62 @@
 // the size allocated for each mmap
 #define ALLOC_CHUNK 2097152
 
+// the size of a span unit, chunks are divided into runs of units
+// (spans) that are owned by one bucket
+#define SPAN_UNIT 65536
+
+// the number of span units in a chunk
+#define CHUNK_UNITS 32
+
+// the maximum number of objects in a thread cache for one bucket
+#define CACHE_MAX_OBJECTS 512
+
+// the maximum number of objects moved between a thread cache and the
+// arena stacks at once
+#define CACHE_BATCH 32
+
+// the number of recently freed slots an arena stack remembers for
+// reuse, a full refill batch
+#define HOT_SLOTS 32
+
+// per cpu caches use restartable sequences (rseq) registered by glibc,
+// the critical sections are written for x86_64 linux only
+#if defined(__x86_64__) && defined(__linux__)
+#define PERCPU_RSEQ 1
+#endif
+
+// the maximum number of objects in a per cpu cache for one bucket
+#define PERCPU_OBJECTS 128
+
+// the maximum number of batches in the transfer cache of one bucket
+#define TRANSFER_BATCHES 64
+
+// the number of futex words a spin_mutex parks its waiters on, a waiter
+// parks on the word of its ticket so an unlock only wakes the waiters
+// whose ticket shares the word of the ticket being served
+#define SPIN_WAIT_WORDS 8
+
+// the maximum path length of a cgroup file read by the pressure
+// watcher
+#define CGROUP_PATH_MAX 512
+
+// the number of address bits resolved by each of the two page map
+// levels, together with the 16 bits of a SPAN_UNIT they cover a 48 bit
+// address space
+#define PAGE_MAP_BITS 16
+
 
 // the number of longs needed to represent the bitmap (see notes)
 // calculation:
-// (ALLOC_CHUNK - sizeof(uint8_t) - sizeof(page_header*) -
-// sizeof(uint32_t) - (BITMAP_LONGS * sizeof(uint64_t))
+// (SPAN_UNIT - sizeof(page_header) without the bitmap -
+// (BITMAP_LONGS * sizeof(uint64_t)) rounded up to a cache line)
 //      = free_size
-// free_size / (BUCKET_MIN + sizeof(uint8_t) + sizeof(uint32_t))
+// free_size / BUCKET_MIN
 //      = free_slots
 // free_slots / (sizeof(uint64_t) * 8 bits)
 //      = BITMAP_LONGS
-// value allows for up to 159808 buckets per mmap
-#define BITMAP_LONGS 2497
+// value allows for up to 8064 buckets per span
+#define BITMAP_LONGS 126
 
 
 
@@ -58,12 +120,13 @@
 
 
 // constructor attribute... initializes all mutexes on startup,
-// no thread safe properties
-void initialize_mutexes (void) __attribute__ ((constructor));
+// no thread safe properties, runs before the program's own static
+// constructors since they may already allocate through operator new
+static void initialize_mutexes (void) __attribute__ ((constructor (101)));
 
-// destructor attribute... frees all buckets on when program
-// terminates
-void free_all_buckets (void) __attribute__ ((destructor));
+// destructor attribute... stops the pressure watcher when the program
+// terminates, the heap stays mapped and usable
+static void finalize_heap (void) __attribute__ ((destructor));
 
 
 
@@ -71,49 +134,249 @@ void free_all_buckets (void) __attribute__ ((destructor));
 
 
 
-// every page has a header if it appears in a bucket
-// a header has an encoded size, pointer to next page and a bitmap of
-// free buckets for the page
+// a fair lock for short critical sections, a ticket lock whose waiters
+// spin briefly and then park on a futex
+// a lock has the next ticket to hand out, the ticket being served, the
+// number of parked waiters and the futex words they park on by ticket,
+// each counting the unlocks that served one of its tickets, all zero is
+// unlocked
+typedef struct spin_mutex {
+    uint32_t next;
+    uint32_t serving;
+    uint32_t parked;
+    uint32_t wakes[SPIN_WAIT_WORDS];
+} spin_mutex;
+
+// every span has a header if it appears in a bucket
+// a header has an encoded size, its bucket index and owning arena, its
+// first unit and number of units in the owning chunk, whether a thread
+// owns it, its cache color (the bytes its first slot is moved past
+// c_Span_Data_Offset), pointers to the next and previous spans, the
+// number of slots in use and a bitmap of free buckets for the span
+// a thread owned span has the owning thread's id (0 once abandoned),
+// the number of slots carved into free lists, the list of slots freed
+// by the owner and the list other threads free onto atomically, it
+// does not use its bitmap
 typedef struct page_header {
     uint8_t size;
+    uint8_t bucket;
+    uint8_t arena;
+    uint8_t unit;
+    uint8_t units;
+    uint8_t owned;
+    uint16_t color;
     struct page_header* next_page;
+    struct page_header* prev_page;
+    struct chunk_header* chunk;
     uint32_t last_offset;
+    uint32_t used;
+    uint32_t owner;
+    uint32_t carved;
+    void* local_free;
+    void* thread_free;
     uint64_t bitmap[BITMAP_LONGS];
 } page_header;
 
+// every mmapped chunk has a header kept outside of the chunk
+// a chunk header has the chunk base address, a mask of its free units
+// (bit n is unit n) and a pointer to the next chunk
+typedef struct chunk_header {
+    void* base;
+    uint32_t free_units;
+    struct chunk_header* next_chunk;
+} chunk_header;
+
+// every free range of the reserved large address space has a node
+// kept outside of the range
+// a node has the range base address and size and a pointer to the next
+// range in address order
+typedef struct large_range {
+    void* base;
+    size_t size;
+    struct large_range* next_range;
+} large_range;
+
+// every thread has a cache for each bucket
+// a cache has a list of free objects (linked through their first 8
+// bytes), its length and capacity, the number of misses to the arena
+// stacks since the last garbage collection tick and the favorite arena
+typedef struct bucket_cache {
+    void* head;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t misses;
+    uint8_t favorite_arena;
+} bucket_cache;
+
+// every arena stack remembers the slots most recently pushed back to
+// its spans, so a refill takes slots that are likely still cached
+// a hot slot has its span and slot offset, the stack is a ring buffer
+// whose oldest slots are overwritten, with the index of the newest and
+// the number held
+typedef struct hot_slot {
+    page_header* header;
+    uint32_t offset;
+} hot_slot;
+
+typedef struct hot_stack {
+    uint32_t top;
+    uint32_t count;
+    hot_slot slots[HOT_SLOTS];
+} hot_stack;
+
+// every thread has a list of the spans it owns for each bucket when
+// thread owned spans are used
+// a list has the span allocated from, the last span and the number of
+// spans past the first with no slots in use, which are kept for reuse
+typedef struct owned_list {
+    page_header* head;
+    page_header* tail;
+    uint32_t empty;
+} owned_list;
+
+// every cpu has a cache for each bucket when per cpu caches are used
+// a cache has the number of objects it holds, its capacity and the
+// objects, the layout is fixed since rseq critical sections use it
+typedef struct percpu_cache {
+    uint32_t count;
+    uint32_t capacity;
+    void* objects[PERCPU_OBJECTS];
+} percpu_cache;
+
+// every bucket has a central transfer cache between thread caches
+// a transfer cache has a mutex, the number of batches it holds and the
+// batches, each a list of CACHE_BATCH objects linked like a thread cache
+typedef struct transfer_cache {
+    spin_mutex mutex;
+    uint32_t count;
+    void* batches[TRANSFER_BATCHES];
+} transfer_cache;
+
 
 
 // --------- CONSTANTS ----------------------------------------------
 
 
 
-// the non bucket xmalloc flag, indicates previous 8 bytes are the
-// size of the mmap
-const uint8_t c_Non_Bucket_Flag =            0xFF;
+// the non bucket page map flag, set in the low bit of a page map
+// entry whose remaining bits are the size of the mmap, entries without
+// it are the page_header of the owning span
+static const uint64_t c_Non_Bucket_Flag =           0x0000000000000001;
+
+// the non bucket tail page map flag, set in the low bits of the page
+// map entries of every unit after the first of a non bucket mmap whose
+// remaining bits are the mmap base address
+static const uint64_t c_Non_Bucket_Tail_Flag =      0x0000000000000002;
+
+// the offset of the first slot in a span, the header rounded up to a
+// cache line so slots of power of two buckets are naturally alligned
+// (larger power of two buckets start past it, see g_Bucket_Align_Colors)
+static const uint32_t c_Span_Data_Offset =          (sizeof(page_header) + 0x3F) & ~0x3F;
+
+// the largest allignment a bucket slot can have, the largest bucket,
+// slots of power of two buckets are alligned to their size and the
+// others to a cache line at most, bigger allignments use non bucket
+// mmaps
+static const uint32_t c_Bucket_Align_Max =          0x00002000;
+
+// the step between span colors, a cache line
+static const uint32_t c_Color_Bytes =               0x00000040;
+
+// the smallest bucket (16 bytes) whose slots have a second word for the
+// free key of a hardened xfree, hardened xmallocs of smaller buckets
+// use it instead
+static const int c_Free_Key_Bucket =                0x00000002;
+
+// mask of the index into a page map level
+static const uint64_t c_Page_Map_Mask =             (0x1 << PAGE_MAP_BITS) - 1;
+
+// the cgroup is under pressure when memory.current reaches this many
+// percent of memory.high (or memory.max if there is no high limit)
+static const uint32_t c_Pressure_Usage_Percent =    0x5A;
+
+// the cgroup is under pressure when the PSI 'some' average over the
+// last 10 seconds reaches this many hundredths of a percent of stall
+static const uint32_t c_Pressure_Stall_Hundredths = 0x03E8;
+
+// the default interval in milliseconds between pressure watcher polls
+static const uint32_t c_Pressure_Interval_Ms =      0x03E8;
+
+// the maximum bytes of capacity of one thread cache for one bucket
+static const uint32_t c_Cache_Max_Bytes =           0x00010000;
+
+// the maximum bytes of capacity of all thread caches of all threads
+static const size_t c_Cache_Global_Max_Bytes =      0x02000000;
+
+// the maximum bytes held by the transfer cache of one bucket
+static const size_t c_Transfer_Max_Bytes =          0x00100000;
+
+// the number of times a waiter on a spin_mutex checks its ticket before
+// parking, for each ticket ahead of it, on a multi cpu machine
+static const uint32_t c_Spin_Checks =               0x00000080;
+
+// the number of spans checked in each other arena for a free slot
+// before a bucket maps a new span
+static const uint32_t c_Steal_Spans =               0x00000100;
+
+// the default number of partly free spans an arena stack may hold
+// beyond the poorest arena of its bucket before spans are moved
+static const uint32_t c_Arena_Band =                0x00000004;
+
+// the number of refills of a bucket from the arena stacks by a thread
+// between rebalancing the arenas of the bucket
+static const uint32_t c_Rebalance_Pops =            0x00000100;
+
+// the bytes around a free slot found in a span that a randomized pop
+// picks from, at least c_Random_Window_Slots and at most a bitmap word
+static const uint32_t c_Random_Window_Bytes =       0x00001000;
+static const uint32_t c_Random_Window_Slots =       0x00000008;
 
-// the bucket xmalloc flag, indicates previous 4 bytes are the offset
-// to the mmap page_header
-const uint8_t c_Bucket_Flag =                0x00;
+// the bytes of address space reserved at a time for non bucket mmaps,
+// each block is carved from it so neighbouring blocks share a mapping
+static const size_t c_Large_Reserve =               0x40000000;
 
-// the metadata size for a non bucket, one uint8_t flag and size_t
-const uint8_t c_Non_Bucket_Metadata_Size =   0x09;
+// the smallest non bucket block whose pages are moved with mremap
+// rather than copied when xrealloc cannot grow it in place, each move
+// splits the mappings of the large address space for good, so only
+// blocks this big, whose copy costs milliseconds, are moved
+static const size_t c_Remap_Min =                   0x02000000;
 
-// the meta data size for a bucket, one uint8_t flag and one uint32_t
-const uint8_t c_Bucket_Metadata_Size =       0x05;
+// the smallest xrealloc copy that uses non temporal stores, larger
+// copies would only evict the cache for data the caller may not touch
+static const size_t c_Stream_Copy_Min =             0x00400000;
 
-// the minimum number of pages needed for the header
-const uint8_t c_Header_Pages_Needed =        0x05;
+// the number of size classes for non bucket mmaps per doubling of size
+static const uint32_t c_Large_Classes =             0x00000004;
+
+// the number of thread cache allocations between garbage collection
+// ticks, a tick shrinks the caches of buckets that did not miss
+static const uint32_t c_Cache_Tick_Allocs =         0x00001000;
+
+// the bytes of never used slots a thread owned span carves into its
+// free list at a time, so pages are only touched once needed
+static const uint32_t c_Owned_Carve_Bytes =         0x00001000;
+
+// the number of other owned spans a thread checks for free slots when
+// its current span is full, before adopting or taking a new span
+static const uint32_t c_Owned_Scan =                0x00000010;
+
+// the number of spans with no slots in use a thread keeps per bucket
+// beyond its current span, more are released
+static const uint32_t c_Owned_Empty_Spans =         0x00000001;
+
+// all units of a chunk are free
+static const uint32_t c_Chunk_All_Free =            0xFFFFFFFF;
 
 // used for checking bitmaps, the most significant bit at position 63
 // is the only one set to 1
-const uint64_t c_64_MSB_High =               0x8000000000000000;
+static const uint64_t c_64_MSB_High =               0x8000000000000000;
 
 // used for checking bitmaps, all bits high corresponds no free slots
 // to pop from stack
-const uint64_t c_64_All_High =               0xFFFFFFFFFFFFFFFF;
+static const uint64_t c_64_All_High =               0xFFFFFFFFFFFFFFFF;
 
 // mask to get an address alligned to its mmapped page
-const uint64_t c_4K_Mask =                   0xFFFFFFFFFFFF1000;
+static const uint64_t c_4K_Mask __attribute__ ((unused)) = 0xFFFFFFFFFFFF1000;
 
 /*                           bucket sizes = { 8,            12,           16,           24,
                                               32,           48,           64,           96,
@@ -122,28 +385,53 @@ const uint64_t c_4K_Mask =                   0xFFFFFFFFFFFF1000;
                                               2048,         3072,         4096,         6144,
                                               8192       } */
 // the bucket sizes for the bucket stacks
-const uint32_t c_Bucket_Sizes[BUCKET_NUM] = { 0x00000008,   0x0000000C,   0x00000010,   0x00000018,  
+static const uint32_t c_Bucket_Sizes[BUCKET_NUM] = { 0x00000008,   0x0000000C,   0x00000010,   0x00000018,  
                                               0x00000020,   0x00000030,   0x00000040,   0x00000060,
                                               0x00000080,   0x000000C0,   0x00000100,   0x00000180,
                                               0x00000200,   0x00000300,   0x00000400,   0x00000600,
                                               0x00000800,   0x00000C00,   0x00001000,   0x00001800,
                                               0x00002000 };
 
-// the number of ALLOC_CHUNKS by bucket index, chunks are chosen such
-// that the resulting number of free slots does not exceed the bitmap,
-// but only grow by a factor of two between adjacent buckets so the
-// total allocations do not grow too large
-const uint8_t c_MMAP_Chunks[BUCKET_NUM] =  { 0x01, 0x01, 0x01, 0x01, 0x02, 0x02, 0x02, 0x02,
-                                             0x04, 0x04, 0x04, 0x04, 0x08, 0x08, 0x08, 0x08,
-                                             0x10, 0x10, 0x10, 0x10, 0x20 };
+// the number of SPAN_UNITS by bucket index, units are chosen such
+// that the resulting number of free slots does not exceed the bitmap
+// and every span holds at least 63 slots, while keeping spans small so
+// memory is reclaimed and reassigned at close to unit granularity
+static const uint8_t c_Span_Units[BUCKET_NUM] =   { 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+                                             0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x02, 0x02,
+                                             0x04, 0x04, 0x08, 0x08, 0x08 };
 
 
 // --------- THREAD LOCALS ------------------------------------------
 
 
-// each threads favorite arena to use based on the bucket index
-// these are the second indexer to the global g_Bucket_Stacks
-__thread uint8_t t_Favorite_Arenas[BUCKET_NUM];
+// each threads cache of free objects and favorite arena to use based
+// on the bucket index, the favorite arenas are the second indexer to
+// the global g_Bucket_Stacks
+static __thread bucket_cache t_Bucket_Caches[BUCKET_NUM];
+
+// the number of cache allocations until the next garbage collection
+// tick
+static __thread uint32_t t_Cache_Ticks;
+
+// the cache flush epoch last seen by the thread
+static __thread uint32_t t_Cache_Epoch;
+
+// set once the thread has registered its cache for flushing on exit
+static __thread uint8_t t_Cache_Registered;
+
+// the number of refills from the arena stacks until the next rebalance
+static __thread uint32_t t_Rebalance_Pops;
+
+// the xorshift state of the thread for randomized pops, seeded on
+// first use
+static __thread uint64_t t_Random;
+
+// the spans the thread owns by bucket index, its owner id (0 until it
+// first takes a span) and whether it has registered to abandon its
+// spans when it exits
+static __thread owned_list t_Owned_Spans[BUCKET_NUM];
+static __thread uint32_t t_Owner_Id;
+static __thread uint8_t t_Owned_Registered;
 
 
 
@@ -155,7 +443,186 @@ __thread uint8_t t_Favorite_Arenas[BUCKET_NUM];
 static page_header* g_Bucket_Stacks[BUCKET_NUM][ARENA_NUM];
 
 // there is a mutex for each bucket
-static pthread_mutex_t g_Free_Bucket_Mutexes[BUCKET_NUM][ARENA_NUM];
+static spin_mutex g_Free_Bucket_Mutexes[BUCKET_NUM][ARENA_NUM];
+
+// spans mapped for an arena without its lock held, pushed lock free and
+// linked into the arena stack by the next thread to hold the lock
+static page_header* g_New_Spans[BUCKET_NUM][ARENA_NUM];
+
+// the slots most recently pushed back to each arena stack, protected by
+// its mutex
+static hot_stack g_Hot_Slots[BUCKET_NUM][ARENA_NUM];
+
+// the number of partly free spans an arena stack may hold beyond the
+// poorest arena of its bucket, set from XMALLOC_ARENA_BAND
+static uint32_t g_Arena_Band = c_Arena_Band;
+
+// the number of times a spin_mutex waiter spins per ticket ahead of it,
+// 0 on a single cpu where the holder cannot run while a waiter spins
+static uint32_t g_Spin_Checks;
+
+// every mmapped chunk, the free units of all chunks form the pool of
+// memory shared by all buckets
+static chunk_header* g_Chunks;
+
+// chunk headers of munmapped chunks, reused for the next chunk mmapped
+static chunk_header* g_Free_Chunk_Headers;
+
+// protects the chunk list and the free units and page map of chunks
+static pthread_mutex_t g_Chunk_Pool_Mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// the next free byte and end of the current block of allocator
+// metadata (chunk headers)
+static void* g_Metadata_Next;
+static void* g_Metadata_End;
+
+// protects the allocator metadata block
+static pthread_mutex_t g_Metadata_Mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// the address space reserved at startup (XMALLOC_RESERVE bytes, 0 if
+// not reserved), chunks are committed from its bottom and large address
+// space from its top
+static void* g_Reserve_Base;
+static size_t g_Reserve_Size;
+static size_t g_Reserve_Low;
+static size_t g_Reserve_High;
+
+// set while everything xmalloc maps lies in the reserved address space
+static uint8_t g_Reserve_Only;
+
+// protects the committed ends of the reserved address space
+static pthread_mutex_t g_Reserve_Mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// the free ranges of the reserved large address space in address
+// order, no two are adjacent, and the nodes not holding a range
+static large_range* g_Large_Free;
+static large_range* g_Large_Nodes;
+
+// protects the free large ranges and nodes
+static pthread_mutex_t g_Large_Mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// set once mremap rejects MREMAP_DONTUNMAP (kernels before 5.7)
+static uint8_t g_No_Dontunmap;
+
+// the widest non temporal copy the cpu supports, chosen at startup,
+// null where there is none
+static void (*g_Stream_Copy)(void* dst, const void* src, size_t size);
+
+// the page map from every SPAN_UNIT of memory owned by xmalloc to its
+// page map entry, the first level is indexed by the high address bits
+// and points to lazily mmapped leaves indexed by the unit number, both
+// levels are read without locks
+static uint64_t* g_Page_Map[0x1 << PAGE_MAP_BITS];
+
+// the number of bytes in spans taken by buckets and in non bucket
+// mmaps, updated atomically
+static size_t g_Heap_Bytes;
+
+// the heap limits in bytes, 0 is no limit, above the soft limit free
+// memory is purged, above the hard limit xmalloc returns null
+static size_t g_Soft_Limit;
+static size_t g_Hard_Limit;
+
+// the heap bytes left after the last purge, the soft limit only purges
+// again once the heap has grown by an eighth of the limit (at least a
+// chunk) since, so live data above the limit is not purged for again
+// on every chunk taken
+static size_t g_Purged_Heap_Bytes;
+
+// held while purging so only one thread purges at a time
+static pthread_mutex_t g_Purge_Mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// the pressure watcher thread, its cgroup directory and poll interval,
+// and whether it is running or asked to stop
+static pthread_t g_Pressure_Thread;
+static char g_Pressure_Cgroup[CGROUP_PATH_MAX];
+static uint32_t g_Pressure_Interval_Ms;
+static int g_Pressure_Running;
+static int g_Pressure_Stop;
+
+// set once a poll purged while the cgroup stays under pressure, cleared
+// when a poll finds no pressure
+static int g_Pressure_Purged;
+
+// protects starting and stopping the pressure watcher
+static pthread_mutex_t g_Pressure_Mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// the XMALLOC_HARDEN flags, free validates every pointer against its
+// span and random picks slots pseudo randomly, set from
+// XMALLOC_HARDENED or xmalloc_set_hardened
+static uint8_t g_Hardened;
+
+// the number of slots in a span and the reciprocal of the slot size
+// (2^40 / size rounded up) by bucket index, so a hardened xfree finds
+// the slot of a pointer without dividing
+static uint32_t g_Bucket_Slots[BUCKET_NUM];
+static uint64_t g_Bucket_Reciprocals[BUCKET_NUM];
+
+// the number of cache colors a span of each bucket can take, the cache
+// lines left past its last slot plus one, and the count of spans each
+// bucket has formatted, which picks the next color
+static uint32_t g_Bucket_Colors[BUCKET_NUM];
+static uint32_t g_Span_Colors[BUCKET_NUM];
+
+// the fixed color of every span of a power of two bucket larger than a
+// cache line, the gap rounding its first slot up to a multiple of the
+// bucket size so its slots are alligned to their size, the gap is the
+// space a span has past its last slot so these buckets are not colored
+static uint16_t g_Bucket_Align_Colors[BUCKET_NUM];
+
+// the random key a hardened xfree stores (xored with the pointer) in
+// the second word of a freed slot so a second free of it is recognised
+static uint64_t g_Free_Key;
+
+// called with each invalid pointer passed to xfree, null logs the
+// error and exits
+static xmalloc_error_handler g_Error_Handler;
+
+// the bytes of capacity of all thread caches, updated atomically
+static size_t g_Cache_Capacity_Bytes;
+
+// incremented to make every thread flush its caches on its next
+// allocation or free
+static uint32_t g_Cache_Epoch;
+
+// the key whose destructor flushes a thread's caches when it exits,
+// set once the key is created, a thread allocating before then (from
+// another library's constructor) registers on a later call
+static pthread_key_t g_Cache_Key;
+static int g_Cache_Key_Ready;
+
+// set from XMALLOC_OWNED_SPANS at startup, bucket slots come from spans
+// owned by each thread instead of the caches and arena stacks
+static uint8_t g_Owned;
+
+// the last owner id handed to a thread, ids start at 1
+static uint32_t g_Owner_Ids;
+
+// the key whose destructor abandons a thread's owned spans
+static pthread_key_t g_Owned_Key;
+
+// the spans left by exited threads with slots still in use, by bucket,
+// adopted by the next thread of the bucket that needs a span
+static page_header* g_Abandoned_Spans[BUCKET_NUM];
+static spin_mutex g_Abandoned_Mutexes[BUCKET_NUM];
+
+// the per cpu caches, BUCKET_NUM caches for each configured cpu, null
+// when rseq is unavailable and thread caches are used instead
+static percpu_cache* g_Percpu_Caches;
+
+// the number of configured cpus with per cpu caches
+static uint32_t g_Percpu_Num;
+
+#ifdef PERCPU_RSEQ
+// the offset of the rseq area from the thread pointer and its size,
+// exported by glibc 2.35+ which registers rseq for every thread, weak
+// so older libcs link and fall back to thread caches
+extern const ptrdiff_t __rseq_offset __attribute__ ((weak));
+extern const unsigned int __rseq_size __attribute__ ((weak));
+#endif
+
+// the transfer caches of batches moving between thread caches
+static transfer_cache g_Transfer_Caches[BUCKET_NUM];
 
 
 
@@ -167,7 +634,7 @@ static pthread_mutex_t g_Free_Bucket_Mutexes[BUCKET_NUM][ARENA_NUM];
 // significant bit represents whether the size is intermediate (12,
 // 24, 48 etc..) or a base 2 value (4, 8, 16 etc..) and the least
 // significant bits represent the power of the bucket (2^n)
-size_t parse_header_size(uint8_t size) {
+static __attribute__ ((unused)) size_t parse_header_size(uint8_t size) {
 
     // get the intermediate value at bit 7
     uint8_t intermediate = (uint8_t)(size >> 0x07);
@@ -187,7 +654,7 @@ size_t parse_header_size(uint8_t size) {
 }
 
 // generates an encoded size_t in only 1 byte for the header
-uint8_t gen_header_size(size_t size) {
+static uint8_t gen_header_size(size_t size) {
     assert(size >= BUCKET_MIN);
 
     // all intermediate values are divisble by 3
@@ -206,369 +673,3260 @@ uint8_t gen_header_size(size_t size) {
 
 
 
-// --------- MMAP FUNCTIONS -----------------------------------------
+// --------- SPIN LOCK FUNCTIONS ------------------------------------
 
 
 
-// mmaps an constant sized piece of memory, all pages other than
-// the ones with the page_header data are madvised as DONTNEED
-void* mmap_bucket(int bucket_i) {
-    assert(bucket_i >= 0 && bucket_i < BUCKET_NUM);
+// tells the cpu the thread is spinning
+static inline void spin_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
 
-    // set the size of the mmap and the number of pages needed so the
-    // header is NOT madvised as DONTNEED
-    size_t mmap_size = c_MMAP_Chunks[bucket_i] * ALLOC_CHUNK;
-    
-    // mmap and madvise if needed, check errors
-    void* new_bucket = mmap(0, mmap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (!new_bucket) {
-        fprintf(stderr, "mmap failed for size %lu\n", mmap_size);
-        exit(1);
-    }
-    
-    // mark all pages without header data as DONTNEED
-    if (madvise(new_bucket + (SMALL_PAGE * c_Header_Pages_Needed), mmap_size - (SMALL_PAGE * c_Header_Pages_Needed), MADV_DONTNEED)) {
-        fprintf(stderr, "madvise error at %p of size %lu\n", new_bucket, mmap_size);
-        exit(1);
+// locks a spin_mutex, tickets are served in order so waiters are fair,
+// a waiter spins in proportion to its distance from the ticket being
+// served and then parks on the futex word of its ticket until its
+// ticket is served
+static void spin_lock(spin_mutex* mutex) {
+    uint32_t ticket = __atomic_fetch_add(&mutex->next, 1, __ATOMIC_RELAXED);
+    uint32_t serving = __atomic_load_n(&mutex->serving, __ATOMIC_ACQUIRE);
+    uint32_t* word = &mutex->wakes[ticket % SPIN_WAIT_WORDS];
+    uint32_t wakes;
+    uint32_t checks;
+
+    // the lock was free
+    if (serving == ticket) {
+        return;
     }
 
-    // write header data
-    ((page_header*)new_bucket)->size = gen_header_size(c_Bucket_Sizes[bucket_i]);
+    // spin while the holder and waiters ahead finish
+    checks = g_Spin_Checks * (ticket - serving);
+    while (checks--) {
+        spin_pause();
+        if (__atomic_load_n(&mutex->serving, __ATOMIC_ACQUIRE) == ticket) {
+            return;
+        }
+    }
 
-    return new_bucket;
+    // park until it is this ticket's turn, the word is read before the
+    // served ticket so an unlock between them fails the futex wait
+    __atomic_add_fetch(&mutex->parked, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+        wakes = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&mutex->serving, __ATOMIC_SEQ_CST) == ticket) {
+            break;
+        }
+        syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, wakes, 0, 0, 0);
+    }
+    __atomic_sub_fetch(&mutex->parked, 1, __ATOMIC_RELAXED);
 }
 
-// mmaps memory for data that does not lie within a valid bucket range
-void* mmap_non_bucket(size_t size) {
-    assert(size > BUCKET_MAX);
+// locks a spin_mutex only if it is free, returns 0 on success like
+// pthread_mutex_trylock
+static int spin_trylock(spin_mutex* mutex) {
+    uint32_t serving = __atomic_load_n(&mutex->serving, __ATOMIC_ACQUIRE);
+    uint32_t ticket = serving;
 
-    // set size to include metadata and get the total number of bytes
-    // needed alligned to a 4K page
-    size += c_Non_Bucket_Metadata_Size;
-    size = ((size / SMALL_PAGE) + (size % SMALL_PAGE == 0 ? 0x0 : 0x1)) * SMALL_PAGE;
-   
-    // mmap the size
-    void* ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (!ptr) {
-        fprintf(stderr, "mmap failed for large size %lu\n", size);
-        exit(1);
-    }
+    return !__atomic_compare_exchange_n(&mutex->next, &ticket, serving + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
 
-    // set the metadata
-    *((size_t*)ptr) = size;
-    ptr += sizeof(size_t);
-    *((uint8_t*)ptr) = c_Non_Bucket_Flag;
-    ptr += sizeof(uint8_t);
+// unlocks a spin_mutex, serving the next ticket and waking the waiters
+// parked on its word, normally just the one holding it, waiters of the
+// other tickets sharing the word park again
+static void spin_unlock(spin_mutex* mutex) {
+    uint32_t serving = __atomic_add_fetch(&mutex->serving, 1, __ATOMIC_SEQ_CST);
+    uint32_t* word = &mutex->wakes[serving % SPIN_WAIT_WORDS];
 
-    // return the pointer after the metadata
-    return ptr;
+    if (__atomic_load_n(&mutex->parked, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, 0, 0, 0);
+    }
 }
 
 
 
-// --------- XMALLOC PUSH/POP FUNCTIONS FOR STACKS ------------------
-
+// --------- PAGE MAP FUNCTIONS -------------------------------------
 
 
-// pops a bucket size to return to calling program
-void* pop_bucket(int bucket_i) {
-    uint8_t bitmap_shift;
-    uint32_t offset;
-    uint16_t bitmap_i;
 
-    // set the bitmap size max, assert the size can fit in the bitmap
-    uint32_t bitmap_size = ((c_MMAP_Chunks[bucket_i] * ALLOC_CHUNK) - sizeof(page_header)) / (c_Bucket_Sizes[bucket_i] + c_Bucket_Metadata_Size);
-    assert(bitmap_size <= BITMAP_LONGS * 64);
+// gets the page map entry for the unit containing an address, zero if
+// the address is not owned by xmalloc, the entry is found with two
+// dependent loads and no locks
+static uint64_t get_page_map(const void* addr) {
+    uint64_t key = (uint64_t)addr / SPAN_UNIT;
 
-    // try to lock favorite arena, on lock success return is 0
-    if (pthread_mutex_trylock(&g_Free_Bucket_Mutexes[bucket_i][t_Favorite_Arenas[bucket_i]])) {
-        // change arenas, lock the new stack
-        t_Favorite_Arenas[bucket_i] = (t_Favorite_Arenas[bucket_i] + 1) % ARENA_NUM;
-        pthread_mutex_lock(&g_Free_Bucket_Mutexes[bucket_i][t_Favorite_Arenas[bucket_i]]);
+    // addresses outside of the 48 bit space are never owned
+    if (key >> (PAGE_MAP_BITS * 2)) {
+        return 0x00;
     }
 
-    // set the header and bucket found to false
-    page_header* header = g_Bucket_Stacks[bucket_i][t_Favorite_Arenas[bucket_i]];
-    uint8_t bucket_found = 0x00;
-
-    // loop until null header is found, indicating no free buckets
-    while (header) {
-        // initially check the next slot after the last offset
-        offset = (header->last_offset + 1) % bitmap_size;
-
-        // loop until the offset exceeds the available slots in the
-        // allocate data according to the header
-        while (offset != header->last_offset) {
-            bitmap_i = offset / (sizeof(uint64_t) * 0x08);
-            bitmap_shift = offset % (sizeof(uint64_t) * 0x08);
+    uint64_t* leaf = __atomic_load_n(&g_Page_Map[key >> PAGE_MAP_BITS], __ATOMIC_ACQUIRE);
+    if (!leaf) {
+        return 0x00;
+    }
+    return __atomic_load_n(&leaf[key & c_Page_Map_Mask], __ATOMIC_ACQUIRE);
+}
 
-            // check if the index has any free bits every time the
-            // offset starts a new index in the bitmap
-            if ((bitmap_shift == (uint8_t)0x00) && (header->bitmap[bitmap_i] == c_64_All_High)) {
-                offset += sizeof(uint64_t) * 0x08;
+// sets the page map entry for a number of units starting at an
+// alligned address, missing leaves are mmapped and published with a
+// compare and swap so concurrent setters and readers never lock,
+// clearing never mmaps a leaf so it cannot fail, returns 0 if a leaf
+// mmap fails and the caller clears the units it set
+static int set_page_map(void* addr, size_t units, uint64_t entry) {
+    assert(((uint64_t)addr & (SPAN_UNIT - 1)) == 0);
+
+    uint64_t key = (uint64_t)addr / SPAN_UNIT;
+    uint64_t* leaf;
+    uint64_t* expected;
+
+    while (units--) {
+        assert(!(key >> (PAGE_MAP_BITS * 2)));
+        leaf = __atomic_load_n(&g_Page_Map[key >> PAGE_MAP_BITS], __ATOMIC_ACQUIRE);
+
+        // mmap and publish a missing leaf, the loser of a race unmaps
+        // its leaf and uses the winner's
+        if (!leaf) {
+            if (!entry) {
+                key++;
                 continue;
             }
-            
-            // if current offset is free in the bitmap set bucket
-            // found and break
-            if ((header->bitmap[bitmap_i] & (c_64_MSB_High >> bitmap_shift)) == 0x00) {
-                bucket_found = 0x01;
-                break;
+
+            leaf = mmap(0, sizeof(uint64_t) << PAGE_MAP_BITS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (leaf == MAP_FAILED) {
+                return 0;
             }
 
-            // check the next bit
-            offset = (offset + 0x01) % bitmap_size;
+            expected = 0;
+            if (!__atomic_compare_exchange_n(&g_Page_Map[key >> PAGE_MAP_BITS], &expected, leaf, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                munmap(leaf, sizeof(uint64_t) << PAGE_MAP_BITS);
+                leaf = expected;
+            }
         }
 
-        // break on bucket found
-        if (bucket_found) {
-            break;
-        }
+        __atomic_store_n(&leaf[key & c_Page_Map_Mask], entry, __ATOMIC_RELEASE);
+        key++;
+    }
+    return 1;
+}
+
+
+
+// --------- HEAP LIMIT FUNCTIONS -----------------------------------
+
+
+
+// adds bytes to the heap, fails and returns 0 if the heap would exceed
+// the hard limit
+static int reserve_heap(size_t bytes) {
+    size_t heap_bytes = __atomic_add_fetch(&g_Heap_Bytes, bytes, __ATOMIC_RELAXED);
+    size_t hard_limit = __atomic_load_n(&g_Hard_Limit, __ATOMIC_RELAXED);
 
-        // continue to check the next header
-        header = header->next_page;
+    if (hard_limit && heap_bytes > hard_limit) {
+        __atomic_sub_fetch(&g_Heap_Bytes, bytes, __ATOMIC_RELAXED);
+        return 0;
     }
+    return 1;
+}
+
+// removes bytes from the heap
+static void unreserve_heap(size_t bytes) {
+    __atomic_sub_fetch(&g_Heap_Bytes, bytes, __ATOMIC_RELAXED);
+}
+
+// checks if the heap is far enough over the soft limit to purge
+static int soft_limit_exceeded(void) {
+    size_t heap_bytes = __atomic_load_n(&g_Heap_Bytes, __ATOMIC_RELAXED);
+    size_t soft_limit = __atomic_load_n(&g_Soft_Limit, __ATOMIC_RELAXED);
+    size_t growth = soft_limit / 8 > ALLOC_CHUNK ? soft_limit / 8 : ALLOC_CHUNK;
+
+    return soft_limit && heap_bytes > soft_limit && heap_bytes > __atomic_load_n(&g_Purged_Heap_Bytes, __ATOMIC_RELAXED) + growth;
+}
+
+
 
-    // no bucket found, push a page and get the newest added bucket
-    if (!bucket_found) {
-        // assert all headers were checked
-        assert(!header);
+// --------- MMAP FUNCTIONS -----------------------------------------
+
+
+
+// allocates zeroed memory for allocator metadata, metadata is never
+// freed so it is carved sequentially from mmapped SPAN_UNIT blocks,
+// returns null if the mmap fails
+static void* mmap_metadata(size_t size) {
+    assert(size <= SPAN_UNIT);
 
-        // mmap a new bucket stack and push it
-        header = mmap_bucket(bucket_i);
-        header->next_page = g_Bucket_Stacks[bucket_i][t_Favorite_Arenas[bucket_i]];
-        g_Bucket_Stacks[bucket_i][t_Favorite_Arenas[bucket_i]] = header;
+    // keep all metadata 8 byte alligned
+    size = (size + 0x7) & ~(size_t)0x7;
 
-        // a new stack will always have an initial offset of 0 free
-        offset = 0x0000;
-        bitmap_shift = 0x00;
-        bitmap_i = 0x00;
+    pthread_mutex_lock(&g_Metadata_Mutex);
+
+    // mmap a new block if the current one is exhausted
+    if (g_Metadata_Next + size > g_Metadata_End) {
+        void* block = mmap(0, SPAN_UNIT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED) {
+            pthread_mutex_unlock(&g_Metadata_Mutex);
+            return 0;
+        }
+        g_Metadata_Next = block;
+        g_Metadata_End = g_Metadata_Next + SPAN_UNIT;
     }
 
-    // modify the header bitmap
-    header->last_offset = offset;
-    header->bitmap[bitmap_i] = header->bitmap[bitmap_i] | (c_64_MSB_High >> bitmap_shift);
+    void* ptr = g_Metadata_Next;
+    g_Metadata_Next += size;
 
-    // initialize the return pointer to the offset position
-    void* ptr = ((void*)header) + sizeof(page_header) + (offset * (c_Bucket_Sizes[bucket_i] + c_Bucket_Metadata_Size));
-    
-    // write the metadata
-    *((uint32_t*)ptr) = (uint32_t)(ptr - (void*)header);
-    ptr += sizeof(uint32_t);
-    *((uint8_t*)ptr) = t_Favorite_Arenas[bucket_i];
-    ptr += sizeof(uint8_t);
-
-    // unlock the favorite arenas stack
-    pthread_mutex_unlock(&g_Free_Bucket_Mutexes[bucket_i][t_Favorite_Arenas[bucket_i]]);
-    
+    pthread_mutex_unlock(&g_Metadata_Mutex);
     return ptr;
 }
 
-// pushes a bucket back onto the stack for the given arena
-void push_bucket(int bucket_i, int arena_i, page_header* header, void* addr) {
-    assert(bucket_i >= 0 && bucket_i < BUCKET_NUM);
+// reserves a contiguous range of address space alligned to
+// ALLOC_CHUNK with no access and no memory committed, chunks and large
+// address space are committed from it in order so they sit together
+static void reserve_address_space(size_t size) {
+    size = (size + ALLOC_CHUNK - 1) & ~(size_t)(ALLOC_CHUNK - 1);
+    if (!size || size > SIZE_MAX / 2) {
+        return;
+    }
 
-    // set the offset, get the bitmap index and shift
-    uint32_t offset = (uint32_t)((uint64_t)addr - (uint64_t)header + sizeof(page_header)) / (c_Bucket_Sizes[bucket_i] + c_Bucket_Metadata_Size);
-    uint16_t bitmap_i = offset / (sizeof(uint64_t) * 0x08);
-    uint8_t bitmap_shift = offset % (sizeof(uint64_t) * 0x08);
+    // over map so the range can be trimmed to a chunk
+    void* ptr = mmap(0, size + ALLOC_CHUNK, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return;
+    }
 
-    // lock the arenas stack
-    pthread_mutex_lock(&g_Free_Bucket_Mutexes[bucket_i][arena_i]);
-    
-    // update the bitmap
-    header->bitmap[bitmap_i] = header->bitmap[bitmap_i] & ~(c_64_MSB_High >> bitmap_shift);
+    // unmap the unalligned head and the tail
+    void* base = (void*)(((uint64_t)ptr + ALLOC_CHUNK - 1) & ~(uint64_t)(ALLOC_CHUNK - 1));
+    // a failed trim only leaves unused address space mapped
+    if (base != ptr) {
+        munmap(ptr, base - ptr);
+    }
+    munmap(base + size, (ptr + size + ALLOC_CHUNK) - (base + size));
 
-    // unlock the arenas stack
-    pthread_mutex_unlock(&g_Free_Bucket_Mutexes[bucket_i][arena_i]);
+    g_Reserve_Base = base;
+    g_Reserve_Size = size;
+    g_Reserve_Only = 0x01;
+}
+
+// checks if an address lies in the reserved address space
+static inline int in_reserve(const void* ptr) {
+    return (uint64_t)ptr - (uint64_t)g_Reserve_Base < g_Reserve_Size;
 }
 
+// commits the next bytes of the reserved address space, from its
+// bottom or its top, by making them readable and writable, adjacent
+// commits merge into one mapping, returns null if the reserve is full
+// or the mprotect fails
+static void* commit_reserve(size_t size, int from_top) {
+    void* base = 0;
+
+    pthread_mutex_lock(&g_Reserve_Mutex);
+    if (size <= g_Reserve_Size - g_Reserve_Low - g_Reserve_High) {
+        if (from_top) {
+            g_Reserve_High += size;
+            base = g_Reserve_Base + g_Reserve_Size - g_Reserve_High;
+        }
+        else {
+            base = g_Reserve_Base + g_Reserve_Low;
+            g_Reserve_Low += size;
+        }
 
+        // give the bytes back if they cannot be committed (the kernel is
+        // out of memory or of mappings)
+        if (mprotect(base, size, PROT_READ | PROT_WRITE)) {
+            if (from_top) {
+                g_Reserve_High -= size;
+            }
+            else {
+                g_Reserve_Low -= size;
+            }
+            base = 0;
+        }
+    }
+    pthread_mutex_unlock(&g_Reserve_Mutex);
 
-// --------- XMALLOC HEADER PROTOTYPE IMPLEMENTATIONS ---------------
+    return base;
+}
 
+// mmaps a new chunk alligned to ALLOC_CHUNK, committed from the
+// reserved address space while it lasts, no lock is needed since the
+// chunk is not in the pool yet, returns null if the mmap fails
+static void* mmap_chunk(void) {
+    if (g_Reserve_Size) {
+        void* base = commit_reserve(ALLOC_CHUNK, 0);
+        if (base) {
+            return base;
+        }
+        g_Reserve_Only = 0x00;
+    }
 
+    // over map so an alligned chunk can be trimmed from the mapping
+    size_t mmap_size = ALLOC_CHUNK * 2;
+    void* ptr = mmap(0, mmap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return 0;
+    }
 
-// 'mallocs' a given number of bytes
-void* xmalloc(size_t bytes) {
-    // if bytes is greater than the max bucket do regular mmap
-    if (bytes > BUCKET_MAX) {
-        return mmap_non_bucket(bytes);
+    // unmap the unalligned head and the tail
+    void* base = (void*)(((uint64_t)ptr + ALLOC_CHUNK - 1) & ~(uint64_t)(ALLOC_CHUNK - 1));
+    // a failed trim only leaves unused address space mapped
+    if (base != ptr) {
+        munmap(ptr, base - ptr);
     }
+    munmap(base + ALLOC_CHUNK, (ptr + mmap_size) - (base + ALLOC_CHUNK));
 
-    // determine bucket index from size
-    int bucket_i = 0;
-    while (bytes > c_Bucket_Sizes[bucket_i] && bucket_i < BUCKET_NUM - 1) {
-        bucket_i++;
+    return base;
+}
+
+// adds a mmapped chunk to the chunk list with all units free, the
+// chunk pool mutex must be held, returns null if no header can be mmapped
+static chunk_header* add_chunk(void* base) {
+    // reuse the header of a munmapped chunk if there is one
+    chunk_header* chunk = g_Free_Chunk_Headers;
+    if (chunk) {
+        g_Free_Chunk_Headers = chunk->next_chunk;
+    }
+    else {
+        chunk = mmap_metadata(sizeof(chunk_header));
+        if (!chunk) {
+            return 0;
+        }
     }
-    assert(bytes <= c_Bucket_Sizes[bucket_i] && (bucket_i == 0 ? 1 : bytes > c_Bucket_Sizes[bucket_i - 1]));
 
-    // pop a bucket and return to caller
-    return pop_bucket(bucket_i);    
+    chunk->base = base;
+    chunk->free_units = c_Chunk_All_Free;
+    chunk->next_chunk = g_Chunks;
+    g_Chunks = chunk;
+
+    return chunk;
 }
 
-// 'frees' a given xmalloced pointer
-void xfree(void* ptr) {
-    // do nothing for null pointer
-    if (!ptr) {
-        return;
+// returns the units of an empty span to its chunk, the span is
+// madvised as DONTNEED so its physical pages are released, the units
+// merge with the free units around them and can be taken by any bucket
+static void release_span(page_header* header) {
+    chunk_header* chunk = header->chunk;
+    uint8_t unit = header->unit;
+    uint8_t units = header->units;
+    size_t span_size = (size_t)units * SPAN_UNIT;
+
+    // a failed madvise only leaves the pages resident
+    madvise(header, span_size, MADV_DONTNEED);
+
+    pthread_mutex_lock(&g_Chunk_Pool_Mutex);
+
+    // clear the page map and mark the units free
+    set_page_map(header, units, 0x00);
+    chunk->free_units |= (uint32_t)(((uint64_t)0x1 << units) - 1) << unit;
+
+    pthread_mutex_unlock(&g_Chunk_Pool_Mutex);
+
+    unreserve_heap(span_size);
+}
+
+// finds the first chunk with a run of free units, bit n of runs is set
+// when units n to n + units - 1 are all free, the chunk pool mutex must
+// be held, returns null if no chunk has a free run
+static chunk_header* find_run(uint8_t units, uint32_t* runs) {
+    chunk_header* chunk;
+    uint8_t unit_i;
+
+    for (chunk = g_Chunks; chunk; chunk = chunk->next_chunk) {
+        *runs = chunk->free_units;
+        for (unit_i = 1; unit_i < units && *runs; unit_i++) {
+            *runs &= chunk->free_units >> unit_i;
+        }
+        if (*runs) {
+            return chunk;
+        }
+    }
+
+    return 0;
+}
+
+// takes a run of free units from the first chunk that has one, a new
+// chunk is mmapped if no chunk does, returns the first unit's address
+// or null if the hard limit is reached or the mmap fails
+static page_header* take_span(uint8_t units) {
+    assert(units > 0 && units <= CHUNK_UNITS);
+
+    chunk_header* chunk;
+    uint32_t runs = 0x00;
+    void* base = 0;
+
+    if (!reserve_heap((size_t)units * SPAN_UNIT)) {
+        return 0;
     }
 
-    // set the flag
-    uint8_t flag = *((uint8_t*)(ptr - 1));
+    pthread_mutex_lock(&g_Chunk_Pool_Mutex);
+    chunk = find_run(units, &runs);
+
+    // no free run, mmap a new chunk with the pool unlocked so other
+    // buckets keep taking and releasing spans during the syscalls
+    if (!chunk) {
+        pthread_mutex_unlock(&g_Chunk_Pool_Mutex);
+        base = mmap_chunk();
+        pthread_mutex_lock(&g_Chunk_Pool_Mutex);
+
+        // another thread may have grown the pool or released a span
+        // meanwhile, the new chunk is only added if there is still no
+        // free run, otherwise it is munmapped once the pool is unlocked
+        chunk = find_run(units, &runs);
+        if (!chunk && base) {
+            chunk = add_chunk(base);
+            if (chunk) {
+                runs = chunk->free_units;
+                base = 0;
+            }
+        }
 
-    // if non bucket do regular munmap
-    if (flag == c_Non_Bucket_Flag) {
-        ptr -= c_Non_Bucket_Metadata_Size;
+        // reserved chunks cannot be given back, so they are kept
+        else if (base && in_reserve(base) && add_chunk(base)) {
+            base = 0;
+        }
 
-        // munmap and check error
-        if (munmap(ptr, *((size_t*)ptr))) {
-            fprintf(stderr, "munmap error: %p\n", ptr);
-            exit(1);
+        // a reserved chunk without a header is lost with the reserve
+        if (base && in_reserve(base)) {
+            base = 0;
+        }
+
+        if (!chunk) {
+            pthread_mutex_unlock(&g_Chunk_Pool_Mutex);
+            if (base) {
+                munmap(base, ALLOC_CHUNK);
+            }
+            unreserve_heap((size_t)units * SPAN_UNIT);
+            return 0;
         }
-        return;
     }
 
-    page_header* header;
-    
-    // check if flag is a valid arena
-    if (flag < ARENA_NUM) {
-        ptr -= c_Bucket_Metadata_Size;
-        header = (page_header*)(ptr - *((uint32_t*)ptr));
+    // take the lowest run and set the page map
+    uint8_t unit = (uint8_t)__builtin_ctz(runs);
+    page_header* header = (page_header*)(chunk->base + (size_t)unit * SPAN_UNIT);
+    chunk->free_units &= ~((uint32_t)(((uint64_t)0x1 << units) - 1) << unit);
+
+    pthread_mutex_unlock(&g_Chunk_Pool_Mutex);
+
+    // the pool did not need the chunk mmapped by this thread, a failed
+    // munmap only leaks its address space
+    if (base) {
+        munmap(base, ALLOC_CHUNK);
     }
-    else {
-        fprintf(stderr, "arena flag error at %p, flag: %hhu\n", ptr, flag);
-        exit(1);
+
+    // write the span location, the rest of the header is formatted by
+    // the owning bucket before the span is added to the page map
+    header->chunk = chunk;
+    header->unit = unit;
+    header->units = units;
+
+    return header;
+}
+
+// gets a span for a bucket from the units shared by all buckets and
+// formats its header, the units may have belonged to any bucket so the
+// header is reset and the bitmap cleared, the span is then published
+// in the page map for the given arena, or owned by the given owner id
+// if it is not 0, returns null if there is no span
+static void* mmap_bucket(int bucket_i, int arena_i, uint32_t owner) {
+    assert(bucket_i >= 0 && bucket_i < BUCKET_NUM);
+
+    page_header* header = take_span(c_Span_Units[bucket_i]);
+    if (!header) {
+        return 0;
+    }
+    chunk_header* chunk = header->chunk;
+    uint8_t unit = header->unit;
+
+    // reformat the header
+    memset(header, 0, sizeof(page_header));
+    header->size = gen_header_size(c_Bucket_Sizes[bucket_i]);
+    header->bucket = (uint8_t)bucket_i;
+    header->arena = (uint8_t)arena_i;
+    header->chunk = chunk;
+    header->unit = unit;
+    header->units = c_Span_Units[bucket_i];
+
+    // a thread owned span is marked before it is published, so a free
+    // that finds it in the page map never takes it for an arena span
+    if (owner) {
+        header->owned = 0x01;
+        header->owner = owner;
     }
 
-    // get the bucket size and find its index
-    size_t bucket_size = parse_header_size(header->size);
-    int bucket_i = 0;
+    // start the slots of successive spans a cache line further into the
+    // space past the last slot, so equally indexed slots of different
+    // spans fall in different cache sets instead of all conflicting
+    header->color = g_Bucket_Align_Colors[bucket_i];
+    if (g_Bucket_Colors[bucket_i] > 1) {
+        header->color = (uint16_t)(__atomic_fetch_add(&g_Span_Colors[bucket_i], 1, __ATOMIC_RELAXED) % g_Bucket_Colors[bucket_i] * c_Color_Bytes);
+    }
 
-    while (bucket_i < BUCKET_NUM && c_Bucket_Sizes[bucket_i] != bucket_size) {
-        bucket_i++;
+    // without a page map leaf the span is given back
+    if (!set_page_map(header, header->units, (uint64_t)header)) {
+        release_span(header);
+        return 0;
     }
-    assert(bucket_i < BUCKET_NUM);
 
-    // push the bucket back onto the stack
-    push_bucket(bucket_i, flag, header, ptr);
+    return header;
 }
 
-// 'reallocs' the given pointer to new size, preserves data
-void* xrealloc(void* prev, size_t bytes) {
-    // do nothing with null pointer
-    if (!prev) {
-        return prev;
+// rounds the size of a non bucket mmap up to its size class, there are
+// c_Large_Classes classes per doubling (no finer than a 4K page) so
+// freed blocks can be reused by requests of a similar size
+static size_t large_class(size_t size) {
+    size_t step = ((size_t)0x1 << (63 - __builtin_clzll(size))) / c_Large_Classes;
+
+    if (step < SMALL_PAGE) {
+        step = SMALL_PAGE;
     }
-    
-    void* ptr = prev;
-    uint8_t flag = *((uint8_t*)(prev - 1));
-    size_t prev_bytes = 0x00;
 
-    // if non bucket flag
-    if (flag == c_Non_Bucket_Flag) {
-        ptr -= c_Non_Bucket_Metadata_Size;
-        prev_bytes = *((size_t*)ptr);
+    return (size + step - 1) & ~(step - 1);
+}
 
-        // if new bytes is bigger than prev, or new bytes is less than
-        // 3/4 the previous size, create new pointer and copy old data
-        if (prev_bytes < bytes || bytes < (prev_bytes * 3 / 4)) {
-            ptr = xmalloc(bytes);
-            memcpy(ptr, prev, bytes < prev_bytes ? bytes : prev_bytes);
-            xfree(prev);
-            return ptr;
+// inserts a free range into the large free list in address order and
+// merges it with the free ranges directly before and after it, the
+// large mutex must be held, returns 0 if no node can be mmapped and
+// the range is lost
+static int insert_large_range(void* base, size_t size) {
+    large_range** link = &g_Large_Free;
+    large_range* prev = 0;
+    large_range* node;
+
+    while (*link && (*link)->base < base) {
+        prev = *link;
+        link = &prev->next_range;
+    }
+
+    // merge into the previous range
+    if (prev && prev->base + prev->size == base) {
+        prev->size += size;
+
+        // the range may also close the gap to the next range
+        node = prev->next_range;
+        if (node && prev->base + prev->size == node->base) {
+            prev->size += node->size;
+            prev->next_range = node->next_range;
+            node->next_range = g_Large_Nodes;
+            g_Large_Nodes = node;
         }
+        return 1;
+    }
 
-        // prev_bytes * 3/4 <= bytes <= prev_bytes
-        return prev;
+    // merge into the next range
+    if (*link && base + size == (*link)->base) {
+        (*link)->base = base;
+        (*link)->size += size;
+        return 1;
     }
-    
-    page_header* header;
 
-    // if valid flag, set header
-    if (flag < ARENA_NUM) {
-        ptr -= c_Bucket_Metadata_Size;
-        header = (page_header*)(ptr - *((uint32_t*)ptr));
+    // a range on its own needs a node
+    node = g_Large_Nodes;
+    if (node) {
+        g_Large_Nodes = node->next_range;
     }
     else {
-        fprintf(stderr, "realloc flag error at %p, flag: %hhu\n", ptr, flag);
-        exit(1);
+        node = mmap_metadata(sizeof(large_range));
+        if (!node) {
+            return 0;
+        }
     }
+    node->base = base;
+    node->size = size;
+    node->next_range = *link;
+    *link = node;
+    return 1;
+}
 
-    // get prev byte num and bucket index
-    int bucket_i = 0;
-    prev_bytes = parse_header_size(header->size);
+// takes the lowest free large range that fits a size (SPAN_UNIT
+// alligned), its remainder stays free, the large mutex must be held,
+// returns null if none fits
+static void* take_large_range(size_t size) {
+    large_range** link = &g_Large_Free;
+    large_range* node;
+    void* base;
 
-    // if new bytes does not fit in old (or any) bucket, xmalloc new
-    // and copy data
-    if (bytes > BUCKET_MAX || bytes > prev_bytes || (bytes < (prev_bytes * 2 / 3) && prev_bytes != BUCKET_MIN)) {
-        ptr = xmalloc(bytes);
-        memcpy(ptr, prev, bytes < prev_bytes ? bytes : prev_bytes);
-        xfree(prev);
-        return ptr;
+    while (*link && (*link)->size < size) {
+        link = &(*link)->next_range;
+    }
+    if (!*link) {
+        return 0;
     }
 
-    // data fits, so return prev
-    return prev;
+    node = *link;
+    base = node->base;
+    node->base += size;
+    node->size -= size;
+
+    // the whole range was taken
+    if (!node->size) {
+        *link = node->next_range;
+        node->next_range = g_Large_Nodes;
+        g_Large_Nodes = node;
+    }
+
+    return base;
 }
 
+// reserves more large address space, c_Large_Reserve at a time or the
+// size needed if it is bigger (or the bigger reservation fails), from
+// the reserved address space while it lasts, the space is alligned to
+// a SPAN_UNIT and added to the free ranges, the large mutex must be
+// held, returns 0 if the mmap fails
+static int reserve_large(size_t size) {
+    size_t reserve = size > c_Large_Reserve ? size : c_Large_Reserve;
+    void* ptr;
+
+    // take the space from the top of the reserved address space while it
+    // lasts
+    if (g_Reserve_Size) {
+        ptr = commit_reserve(reserve, 1);
+        if (!ptr && reserve != size) {
+            ptr = commit_reserve(size, 1);
+            reserve = size;
+        }
+        if (ptr) {
+            return insert_large_range(ptr, reserve);
+        }
+        g_Reserve_Only = 0x00;
+        reserve = size > c_Large_Reserve ? size : c_Large_Reserve;
+    }
 
+    // over map so the space can be trimmed to a SPAN_UNIT
+    ptr = mmap(0, reserve + SPAN_UNIT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED && reserve != size) {
+        reserve = size;
+        ptr = mmap(0, reserve + SPAN_UNIT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    if (ptr == MAP_FAILED) {
+        return 0;
+    }
 
-// --------- CONSTRUCTOR/DESTRUCTOR FUNCTIONS -----------------------
+    // unmap the unalligned head and the tail
+    void* base = (void*)(((uint64_t)ptr + SPAN_UNIT - 1) & ~(uint64_t)(SPAN_UNIT - 1));
+    // a failed trim only leaves unused address space mapped
+    if (base != ptr) {
+        munmap(ptr, base - ptr);
+    }
+    if (base + reserve != ptr + reserve + SPAN_UNIT) {
+        munmap(base + reserve, (ptr + reserve + SPAN_UNIT) - (base + reserve));
+    }
 
+    if (!insert_large_range(base, reserve)) {
+        munmap(base, reserve);
+        return 0;
+    }
+    return 1;
+}
 
+// gets memory for data that does not lie within a valid bucket range,
+// the size is rounded to its size class and the block is carved from
+// the reserved large address space at a SPAN_UNIT, the size is kept in
+// the page map entry of its first unit and the following units point
+// back to it, returns null if the hard limit is reached or the mmap
+// fails
+static void* mmap_non_bucket(size_t size) {
+    assert(size > BUCKET_MAX);
 
-// called when program starts
-void initialize_mutexes(void) {
-    // assert preprocessor definitions allign with constants
-    assert(c_Bucket_Sizes[0] == BUCKET_MIN && c_Bucket_Sizes[BUCKET_NUM - 1] == BUCKET_MAX);
-    
-    int bucket_index;
-    int arena_index;
+    // check the size does not overflow when alligned
+    if (size > SIZE_MAX / 2) {
+        return 0;
+    }
 
-    // loop over all buckets
-    for (bucket_index = 0; bucket_index < BUCKET_NUM; bucket_index++) {
-        // loop over each arean for the bucket
-        for (arena_index = 0; arena_index < ARENA_NUM; arena_index++) {
-            // initialize the mutexes
-            pthread_mutex_init(&g_Free_Bucket_Mutexes[bucket_index][arena_index], 0);
-            page_header* header = mmap_bucket(bucket_index);
-            header->next_page = g_Bucket_Stacks[bucket_index][arena_index];
-            g_Bucket_Stacks[bucket_index][arena_index] = header;
-        }
+    size = large_class(size);
+    size_t units_size = (size + SPAN_UNIT - 1) & ~(size_t)(SPAN_UNIT - 1);
+
+    if (!reserve_heap(size)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&g_Large_Mutex);
+    void* base = take_large_range(units_size);
+    if (!base && reserve_large(units_size)) {
+        base = take_large_range(units_size);
+    }
+    pthread_mutex_unlock(&g_Large_Mutex);
+
+    if (!base) {
+        unreserve_heap(size);
+        return 0;
+    }
+
+    // set the page map entries, without a page map leaf the units are
+    // given back
+    if (!set_page_map(base, 0x1, (uint64_t)size | c_Non_Bucket_Flag) ||
+        !set_page_map(base + SPAN_UNIT, (size - 1) / SPAN_UNIT, (uint64_t)base | c_Non_Bucket_Tail_Flag)) {
+        set_page_map(base, units_size / SPAN_UNIT, 0x00);
+        pthread_mutex_lock(&g_Large_Mutex);
+        insert_large_range(base, units_size);
+        pthread_mutex_unlock(&g_Large_Mutex);
+        unreserve_heap(size);
+        return 0;
     }
+
+    return base;
 }
 
-// called when program terminates
-void free_all_buckets(void) {
-    int bucket_index;
-    int arena_index;
-    page_header* header;
-    page_header* next;
+// frees a non bucket block, its pages are madvised as DONTNEED and its
+// units return to the free large ranges, merging with free neighbours
+static void munmap_non_bucket(void* base, size_t size) {
+    size_t units_size = (size + SPAN_UNIT - 1) & ~(size_t)(SPAN_UNIT - 1);
 
-    // loop over all buckets
-    for (bucket_index = 0; bucket_index < BUCKET_NUM; bucket_index++) {
-        // loop over each arena per bucket
-        for (arena_index = 0; arena_index < ARENA_NUM; arena_index++) {
-            // lock the arena bucket
-            pthread_mutex_lock(&g_Free_Bucket_Mutexes[bucket_index][arena_index]);
-            
-            // munmap all headers
-            header = g_Bucket_Stacks[bucket_index][arena_index];
-            while (header) {
-                next = header->next_page;
-                if (munmap(header, c_MMAP_Chunks[bucket_index] * ALLOC_CHUNK)) {
-                    // don't break, continue to trying free the rest of the
-                    // headers
-                    printf("munmap error on destruction\n");
-                }
-                header = next;
+    set_page_map(base, 0x1, 0x00);
+    set_page_map(base + SPAN_UNIT, (size - 1) / SPAN_UNIT, 0x00);
+
+    // a failed madvise only leaves the pages resident
+    madvise(base, size, MADV_DONTNEED);
+
+    // a range without a node is lost
+    pthread_mutex_lock(&g_Large_Mutex);
+    insert_large_range(base, units_size);
+    pthread_mutex_unlock(&g_Large_Mutex);
+
+    unreserve_heap(size);
+}
+
+// resizes a non bucket block in place to the size class of a number of
+// bytes, growing takes the free range right after the block and
+// shrinking madvises the freed pages and returns the freed units to
+// the free ranges, returns 0 if the block cannot grow in place
+static int resize_non_bucket(void* base, size_t size, size_t bytes) {
+    size_t new_size = large_class(bytes);
+    size_t units_size = (size + SPAN_UNIT - 1) & ~(size_t)(SPAN_UNIT - 1);
+    size_t new_units_size = (new_size + SPAN_UNIT - 1) & ~(size_t)(SPAN_UNIT - 1);
+    large_range** link;
+    large_range* node;
+    int resized = 0;
+
+    if (new_size > size) {
+        if (!reserve_heap(new_size - size)) {
+            return 0;
+        }
+
+        // take the start of the free range that follows the block
+        pthread_mutex_lock(&g_Large_Mutex);
+        if (new_units_size == units_size) {
+            resized = 1;
+        }
+        link = &g_Large_Free;
+        while (!resized && *link && (*link)->base < base + units_size) {
+            link = &(*link)->next_range;
+        }
+        node = *link;
+        if (!resized && node && node->base == base + units_size && node->size >= new_units_size - units_size) {
+            node->base += new_units_size - units_size;
+            node->size -= new_units_size - units_size;
+            if (!node->size) {
+                *link = node->next_range;
+                node->next_range = g_Large_Nodes;
+                g_Large_Nodes = node;
             }
+            resized = 1;
+        }
+        pthread_mutex_unlock(&g_Large_Mutex);
 
-            // unlock the arena
-            pthread_mutex_unlock(&g_Free_Bucket_Mutexes[bucket_index][arena_index]);
+        if (!resized) {
+            unreserve_heap(new_size - size);
+            return 0;
         }
+
+        // point the new units back to the block, without a page map
+        // leaf they are given back
+        if (new_units_size > units_size && !set_page_map(base + units_size, (new_units_size - units_size) / SPAN_UNIT, (uint64_t)base | c_Non_Bucket_Tail_Flag)) {
+            set_page_map(base + units_size, (new_units_size - units_size) / SPAN_UNIT, 0x00);
+            pthread_mutex_lock(&g_Large_Mutex);
+            insert_large_range(base + units_size, new_units_size - units_size);
+            pthread_mutex_unlock(&g_Large_Mutex);
+            unreserve_heap(new_size - size);
+            return 0;
+        }
+    }
+    else if (new_size < size) {
+        // the pages are released before the units can be taken again
+        set_page_map(base + new_units_size, (units_size - new_units_size) / SPAN_UNIT, 0x00);
+        madvise(base + new_size, size - new_size, MADV_DONTNEED);
+        if (new_units_size < units_size) {
+            pthread_mutex_lock(&g_Large_Mutex);
+            insert_large_range(base + new_units_size, units_size - new_units_size);
+            pthread_mutex_unlock(&g_Large_Mutex);
+        }
+        unreserve_heap(size - new_size);
+    }
+
+    // the leaves of all the units exist by now, so these cannot fail
+    set_page_map(base, 0x1, (uint64_t)new_size | c_Non_Bucket_Flag);
+    set_page_map(base + SPAN_UNIT, (new_size - 1) / SPAN_UNIT, (uint64_t)base | c_Non_Bucket_Tail_Flag);
+
+    return 1;
+}
+
+// moves the pages of a non bucket block to the start of another with
+// mremap instead of copying them, MREMAP_DONTUNMAP leaves the old block
+// mapped (empty) so the large address space has no hole, without it
+// (kernels before 5.7) the hole could be taken by another thread's mmap
+// before it is mapped again, so the block is copied instead, returns 0
+// if the pages were not moved
+static int remap_non_bucket(void* base, void* new_base, size_t size) {
+    if (g_No_Dontunmap) {
+        return 0;
+    }
+
+    if (mremap(base, size, size, MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP, new_base) != MAP_FAILED) {
+        return 1;
+    }
+    if (errno == EINVAL) {
+        g_No_Dontunmap = 0x01;
+    }
+
+    return 0;
+}
+
+
+
+// --------- COPY FUNCTIONS -----------------------------------------
+
+
+
+#if defined(__x86_64__)
+
+// copies with 16 byte non temporal stores, the stores bypass the cache
+// so a large copy does not evict the caller's working set, the
+// destination is alligned first and the tail copied normally
+static void stream_copy_sse2(void* dst, const void* src, size_t size) {
+    size_t head = (0x10 - ((uint64_t)dst & 0xF)) & 0xF;
+
+    if (head > size) {
+        head = size;
+    }
+
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+
+    for (; size >= 0x40; size -= 0x40, dst += 0x40, src += 0x40) {
+        __m128i a = _mm_loadu_si128((const __m128i*)src);
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + 0x10));
+        __m128i c = _mm_loadu_si128((const __m128i*)(src + 0x20));
+        __m128i d = _mm_loadu_si128((const __m128i*)(src + 0x30));
+        _mm_stream_si128((__m128i*)dst, a);
+        _mm_stream_si128((__m128i*)(dst + 0x10), b);
+        _mm_stream_si128((__m128i*)(dst + 0x20), c);
+        _mm_stream_si128((__m128i*)(dst + 0x30), d);
+    }
+    _mm_sfence();
+
+    memcpy(dst, src, size);
+}
+
+// copies with 32 byte non temporal stores
+static __attribute__ ((target("avx2"))) void stream_copy_avx2(void* dst, const void* src, size_t size) {
+    size_t head = (0x20 - ((uint64_t)dst & 0x1F)) & 0x1F;
+
+    if (head > size) {
+        head = size;
+    }
+
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+
+    for (; size >= 0x80; size -= 0x80, dst += 0x80, src += 0x80) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)src);
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + 0x20));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(src + 0x40));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(src + 0x60));
+        _mm256_stream_si256((__m256i*)dst, a);
+        _mm256_stream_si256((__m256i*)(dst + 0x20), b);
+        _mm256_stream_si256((__m256i*)(dst + 0x40), c);
+        _mm256_stream_si256((__m256i*)(dst + 0x60), d);
+    }
+    _mm_sfence();
+
+    memcpy(dst, src, size);
+}
+
+// copies with 64 byte non temporal stores, a full cache line each
+static __attribute__ ((target("avx512f"))) void stream_copy_avx512(void* dst, const void* src, size_t size) {
+    size_t head = (0x40 - ((uint64_t)dst & 0x3F)) & 0x3F;
+
+    if (head > size) {
+        head = size;
+    }
+
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+
+    for (; size >= 0x100; size -= 0x100, dst += 0x100, src += 0x100) {
+        __m512i a = _mm512_loadu_si512(src);
+        __m512i b = _mm512_loadu_si512(src + 0x40);
+        __m512i c = _mm512_loadu_si512(src + 0x80);
+        __m512i d = _mm512_loadu_si512(src + 0xC0);
+        _mm512_stream_si512((__m512i*)dst, a);
+        _mm512_stream_si512((__m512i*)(dst + 0x40), b);
+        _mm512_stream_si512((__m512i*)(dst + 0x80), c);
+        _mm512_stream_si512((__m512i*)(dst + 0xC0), d);
+    }
+    _mm_sfence();
+
+    memcpy(dst, src, size);
+}
+
+#endif
+
+// chooses the widest non temporal copy the cpu supports
+static void initialize_stream_copy(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        g_Stream_Copy = stream_copy_avx512;
+    }
+    else if (__builtin_cpu_supports("avx2")) {
+        g_Stream_Copy = stream_copy_avx2;
+    }
+    else {
+        g_Stream_Copy = stream_copy_sse2;
+    }
+#endif
+}
+
+// copies the data of a block being reallocated, copies of at least
+// c_Stream_Copy_Min bytes use non temporal stores
+static void copy_realloc(void* dst, const void* src, size_t size) {
+    if (size >= c_Stream_Copy_Min && g_Stream_Copy) {
+        g_Stream_Copy(dst, src, size);
+    }
+    else {
+        memcpy(dst, src, size);
+    }
+}
+
+
+
+// --------- ARENA REBALANCE FUNCTIONS ------------------------------
+
+
+
+// counts the spans of an arena stack with a free slot, -1 if the arena
+// is busy
+static int32_t count_free_spans(int bucket_i, int arena_i, uint32_t bitmap_size) {
+    page_header* header;
+    int32_t count = 0;
+
+    if (spin_trylock(&g_Free_Bucket_Mutexes[bucket_i][arena_i])) {
+        return -1;
+    }
+    for (header = g_Bucket_Stacks[bucket_i][arena_i]; header; header = header->next_page) {
+        count += header->used < bitmap_size;
+    }
+    spin_unlock(&g_Free_Bucket_Mutexes[bucket_i][arena_i]);
+
+    return count;
+}
+
+// forgets the remembered slots of a span about to be released or moved
+// to another arena, the arena mutex must be held, the span is still
+// mapped until it is released with the arena unlocked so its slots
+// must not be popped
+static void forget_hot_slots(int bucket_i, int arena_i, page_header* header) {
+    hot_stack* hot = &g_Hot_Slots[bucket_i][arena_i];
+    uint32_t slot_i;
+
+    for (slot_i = 0; slot_i < HOT_SLOTS; slot_i++) {
+        if (hot->slots[slot_i].header == header) {
+            hot->slots[slot_i].header = 0;
+        }
+    }
+}
+
+// moves up to a number of spans with a free slot from one arena stack
+// of a bucket to another, both arenas are locked in index order and the
+// span arena changes under both locks, returns the number moved
+static uint32_t move_free_spans(int bucket_i, int from_i, int to_i, uint32_t bitmap_size, uint32_t num) {
+    page_header* header;
+    page_header* next;
+    uint32_t moved = 0;
+
+    spin_lock(&g_Free_Bucket_Mutexes[bucket_i][from_i < to_i ? from_i : to_i]);
+    spin_lock(&g_Free_Bucket_Mutexes[bucket_i][from_i < to_i ? to_i : from_i]);
+
+    for (header = g_Bucket_Stacks[bucket_i][from_i]; header && moved < num; header = next) {
+        next = header->next_page;
+        if (header->used >= bitmap_size) {
+            continue;
+        }
+
+        // unlink from the source stack
+        if (header->prev_page) {
+            header->prev_page->next_page = header->next_page;
+        }
+        else {
+            g_Bucket_Stacks[bucket_i][from_i] = header->next_page;
+        }
+        if (header->next_page) {
+            header->next_page->prev_page = header->prev_page;
+        }
+
+        // push onto the destination stack
+        header->prev_page = 0;
+        header->next_page = g_Bucket_Stacks[bucket_i][to_i];
+        if (header->next_page) {
+            header->next_page->prev_page = header;
+        }
+        g_Bucket_Stacks[bucket_i][to_i] = header;
+        __atomic_store_n(&header->arena, (uint8_t)to_i, __ATOMIC_RELAXED);
+
+        // the source arena must not pop a slot of the span once the
+        // destination arena may release or munmap it
+        forget_hot_slots(bucket_i, from_i, header);
+        moved++;
+    }
+
+    spin_unlock(&g_Free_Bucket_Mutexes[bucket_i][to_i]);
+    spin_unlock(&g_Free_Bucket_Mutexes[bucket_i][from_i]);
+
+    return moved;
+}
+
+// moves spans with free slots from the richest arena of a bucket to the
+// poorest until every arena is within g_Arena_Band spans of the poorest,
+// busy arenas are skipped, returns the number of spans moved
+static uint32_t rebalance_bucket(int bucket_i) {
+    uint32_t bitmap_size = ((c_Span_Units[bucket_i] * SPAN_UNIT) - c_Span_Data_Offset) / c_Bucket_Sizes[bucket_i];
+    int32_t counts[ARENA_NUM];
+    int arena_i;
+    int rich_i;
+    int poor_i;
+    uint32_t moved;
+    uint32_t total = 0;
+
+    for (arena_i = 0; arena_i < ARENA_NUM; arena_i++) {
+        counts[arena_i] = count_free_spans(bucket_i, arena_i, bitmap_size);
+    }
+
+    // each move fills the poorest arena, so there are at most as many
+    // moves as arenas
+    for (arena_i = 0; arena_i < ARENA_NUM; arena_i++) {
+        rich_i = -1;
+        poor_i = -1;
+        for (int i = 0; i < ARENA_NUM; i++) {
+            if (counts[i] < 0) {
+                continue;
+            }
+            if (rich_i < 0 || counts[i] > counts[rich_i]) {
+                rich_i = i;
+            }
+            if (poor_i < 0 || counts[i] < counts[poor_i]) {
+                poor_i = i;
+            }
+        }
+        if (rich_i < 0 || (uint32_t)(counts[rich_i] - counts[poor_i]) <= g_Arena_Band) {
+            break;
+        }
+
+        // split the difference, the counts may be stale so use the
+        // number actually moved
+        moved = move_free_spans(bucket_i, rich_i, poor_i, bitmap_size, (uint32_t)(counts[rich_i] - counts[poor_i]) / 2);
+        if (!moved) {
+            break;
+        }
+        counts[rich_i] -= moved;
+        counts[poor_i] += moved;
+        total += moved;
+    }
+
+    return total;
+}
+
+// rebalances the arenas of every bucket, returns the number of spans
+// moved
+size_t xmalloc_rebalance(void) {
+    size_t moved = 0;
+    int bucket_i;
+
+    for (bucket_i = 0; bucket_i < BUCKET_NUM; bucket_i++) {
+        moved += rebalance_bucket(bucket_i);
+    }
+
+    return moved;
+}
+
+
+
+// --------- XMALLOC PUSH/POP FUNCTIONS FOR STACKS ------------------
+
+
+
+// publishes a span mapped for an arena without taking the arena lock,
+// the span is linked through its next page pointer onto a stack that
+// is only ever pushed or taken whole, so a compare and swap on the head
+// is enough and no ABA tag is needed
+static void push_new_span(int bucket_i, int arena_i, page_header* header) {
+    page_header* head = __atomic_load_n(&g_New_Spans[bucket_i][arena_i], __ATOMIC_RELAXED);
+
+    do {
+        header->next_page = head;
+    } while (!__atomic_compare_exchange_n(&g_New_Spans[bucket_i][arena_i], &head, header, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// takes every published span of an arena and links them at the front of
+// its stack, the arena lock must be held
+static void link_new_spans(int bucket_i, int arena_i) {
+    page_header* header;
+    page_header* next;
+
+    if (!__atomic_load_n(&g_New_Spans[bucket_i][arena_i], __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    header = __atomic_exchange_n(&g_New_Spans[bucket_i][arena_i], 0, __ATOMIC_ACQUIRE);
+    for (; header; header = next) {
+        next = header->next_page;
+        header->prev_page = 0;
+        header->next_page = g_Bucket_Stacks[bucket_i][arena_i];
+        if (header->next_page) {
+            header->next_page->prev_page = header;
+        }
+        g_Bucket_Stacks[bucket_i][arena_i] = header;
+    }
+}
+
+// looks in the other arenas of a bucket for a span with a free slot,
+// called holding the lock of the given arena, the other arenas are only
+// trylocked and only their first c_Steal_Spans spans are checked, on
+// success the lock of the given arena is swapped for the span's arena
+static page_header* steal_span(int bucket_i, uint32_t bitmap_size, uint8_t* arena_i) {
+    uint8_t victim_i;
+    uint32_t checked;
+    page_header* header;
+
+    // visit the other arenas in order after the given one
+    for (victim_i = (*arena_i + 1) % ARENA_NUM; victim_i != *arena_i; victim_i = (victim_i + 1) % ARENA_NUM) {
+        // skip arenas that are busy or have no spans
+        if (!__atomic_load_n(&g_Bucket_Stacks[bucket_i][victim_i], __ATOMIC_RELAXED) || spin_trylock(&g_Free_Bucket_Mutexes[bucket_i][victim_i])) {
+            continue;
+        }
+
+        // check the first spans for one with a slot not in use
+        header = g_Bucket_Stacks[bucket_i][victim_i];
+        for (checked = 0; header && checked < c_Steal_Spans; checked++) {
+            if (header->used < bitmap_size) {
+                spin_unlock(&g_Free_Bucket_Mutexes[bucket_i][*arena_i]);
+                *arena_i = victim_i;
+                return header;
+            }
+            header = header->next_page;
+        }
+
+        spin_unlock(&g_Free_Bucket_Mutexes[bucket_i][victim_i]);
+    }
+
+    return 0;
+}
+
+// gets the next pseudo random number of the thread (xorshift64*), the
+// state is seeded from the free key and the thread's address
+static inline uint64_t next_random(void) {
+    if (!t_Random) {
+        t_Random = (g_Free_Key ^ (uint64_t)&t_Random) | 0x1;
+    }
+
+    t_Random ^= t_Random >> 12;
+    t_Random ^= t_Random << 25;
+    t_Random ^= t_Random >> 27;
+    return t_Random * 0x2545F4914F6CDD1D;
+}
+
+// picks a pseudo random free slot in a bitmap word from a window that
+// starts at a free slot found in it, the window is about a page of
+// slots so randomized pops stay close together, the first free slot at
+// or after a random position in the window is taken (wrapping to the
+// first in the window), returns the shift of the slot picked
+static uint8_t random_slot(int bucket_i, uint64_t bitmap, uint8_t bitmap_shift, uint32_t word_slots) {
+    uint32_t window = c_Random_Window_Bytes / c_Bucket_Sizes[bucket_i];
+    uint32_t end;
+    uint32_t start;
+    uint64_t free_bits;
+    uint64_t after;
+
+    if (window < c_Random_Window_Slots) {
+        window = c_Random_Window_Slots;
+    }
+    end = bitmap_shift + window;
+    if (end > word_slots) {
+        end = word_slots;
+    }
+
+    // bits are most significant first, keep the free bits from the
+    // shift found up to the end of the window
+    free_bits = ~bitmap & (c_64_All_High >> bitmap_shift);
+    if (end < 64) {
+        free_bits &= ~(c_64_All_High >> end);
+    }
+
+    // scale the random number to the window instead of dividing
+    start = bitmap_shift + (uint32_t)(((next_random() >> 32) * (end - bitmap_shift)) >> 32);
+    after = free_bits & (c_64_All_High >> start);
+
+    return (uint8_t)__builtin_clzll(after ? after : free_bits);
+}
+
+// remembers a slot pushed back to a span of an arena, the arena mutex
+// must be held
+static inline void push_hot_slot(int bucket_i, int arena_i, page_header* header, uint32_t offset) {
+    hot_stack* hot = &g_Hot_Slots[bucket_i][arena_i];
+
+    hot->top = (hot->top + 1) % HOT_SLOTS;
+    hot->slots[hot->top].header = header;
+    hot->slots[hot->top].offset = offset;
+    if (hot->count < HOT_SLOTS) {
+        hot->count++;
+    }
+}
+
+// pops the most recently freed slot of an arena still free, the arena
+// mutex must be held, a remembered span may since have been released,
+// reformatted or moved, so it must still be mapped as a span of the
+// arena and the slot free in its bitmap, returns null if none is left
+static void* pop_hot_slot(int bucket_i, int arena_i) {
+    hot_stack* hot = &g_Hot_Slots[bucket_i][arena_i];
+
+    while (hot->count) {
+        page_header* header = hot->slots[hot->top].header;
+        uint32_t offset = hot->slots[hot->top].offset;
+        uint16_t bitmap_i = offset / 64;
+        uint64_t bit = c_64_MSB_High >> (offset % 64);
+
+        hot->top = (hot->top + HOT_SLOTS - 1) % HOT_SLOTS;
+        hot->count--;
+
+        if (!header || get_page_map(header) != (uint64_t)header || header->bucket != bucket_i || header->owned ||
+            __atomic_load_n(&header->arena, __ATOMIC_RELAXED) != arena_i || (header->bitmap[bitmap_i] & bit)) {
+            continue;
+        }
+
+        header->bitmap[bitmap_i] |= bit;
+        header->used++;
+        return ((void*)header) + c_Span_Data_Offset + header->color + (offset * c_Bucket_Sizes[bucket_i]);
+    }
+
+    return 0;
+}
+
+// pops up to a number of buckets of a size into a list linked through
+// their first 8 bytes, returns the number popped which is only less
+// than asked for if no memory is left
+static uint32_t pop_buckets(int bucket_i, uint32_t num, void** list) {
+    uint8_t bitmap_shift;
+    uint32_t offset;
+    uint32_t checked;
+    uint16_t bitmap_i;
+    uint32_t popped;
+    uint8_t arena_i;
+    uint8_t steal_failed = 0x00;
+    uint8_t exhausted = 0x00;
+    bucket_cache* cache = &t_Bucket_Caches[bucket_i];
+
+    // set the bitmap size max, assert the size can fit in the bitmap
+    uint32_t bitmap_size = ((c_Span_Units[bucket_i] * SPAN_UNIT) - c_Span_Data_Offset) / c_Bucket_Sizes[bucket_i];
+    assert(bitmap_size <= BITMAP_LONGS * 64);
+
+    // every so many refills even out the arenas of the bucket
+    if (!t_Rebalance_Pops--) {
+        t_Rebalance_Pops = c_Rebalance_Pops;
+        rebalance_bucket(bucket_i);
+    }
+
+    // try to lock favorite arena, on lock success return is 0
+    if (spin_trylock(&g_Free_Bucket_Mutexes[bucket_i][cache->favorite_arena])) {
+        // change arenas, lock the new stack
+        cache->favorite_arena = (cache->favorite_arena + 1) % ARENA_NUM;
+        spin_lock(&g_Free_Bucket_Mutexes[bucket_i][cache->favorite_arena]);
+    }
+    arena_i = cache->favorite_arena;
+    link_new_spans(bucket_i, arena_i);
+
+    // set the header, the search continues from it for every pop
+    page_header* header = g_Bucket_Stacks[bucket_i][arena_i];
+    *list = 0;
+    popped = 0;
+
+    // the most recently freed slots are taken first, unless pops are
+    // randomized, the cyclic search only finds the rest
+    if (!(g_Hardened & XMALLOC_HARDEN_RANDOM)) {
+        void* ptr;
+        while (popped < num && (ptr = pop_hot_slot(bucket_i, arena_i))) {
+            *((void**)ptr) = *list;
+            *list = ptr;
+            popped++;
+        }
+    }
+
+    while (popped < num) {
+        // set bucket found to false
+        uint8_t bucket_found = 0x00;
+
+        // loop until null header is found, indicating no free buckets
+        while (header) {
+            // initially check the next slot after the last offset
+            offset = (header->last_offset + 1) % bitmap_size;
+            checked = 0x00;
+
+            // loop until every slot in the bitmap has been checked once,
+            // wrapping back around to 0 at the end of the bitmap
+            while (checked < bitmap_size) {
+                bitmap_i = offset / (sizeof(uint64_t) * 0x08);
+                bitmap_shift = offset % (sizeof(uint64_t) * 0x08);
+
+                // check if the index has any free bits every time the
+                // offset starts a new index in the bitmap
+                if ((bitmap_shift == (uint8_t)0x00) && (header->bitmap[bitmap_i] == c_64_All_High)) {
+                    offset = (offset + sizeof(uint64_t) * 0x08) % bitmap_size;
+                    checked += sizeof(uint64_t) * 0x08;
+                    continue;
+                }
+            
+                // if current offset is free in the bitmap set bucket
+                // found and break
+                if ((header->bitmap[bitmap_i] & (c_64_MSB_High >> bitmap_shift)) == 0x00) {
+                    bucket_found = 0x01;
+                    break;
+                }
+
+                // check the next bit
+                offset = (offset + 0x01) % bitmap_size;
+                checked++;
+            }
+
+            // break on bucket found
+            if (bucket_found) {
+                break;
+            }
+
+            // continue to check the next header
+            header = header->next_page;
+
+            // the arena is full, take a span with free slots from
+            // another arena before mapping a new one, until a steal
+            // finds nothing
+            if (!header && !steal_failed) {
+                header = steal_span(bucket_i, bitmap_size, &arena_i);
+                steal_failed = !header;
+            }
+        }
+
+        // no bucket found, map a new span and search again
+        if (!bucket_found) {
+            // assert all headers were checked
+            assert(!header);
+
+            // stop if there is no memory left and no span was published
+            // since the last search
+            if (exhausted) {
+                break;
+            }
+
+            // the span is mapped and formatted with the arena unlocked so
+            // a slow mmap or page fault never stalls the arena, it is
+            // published lock free and linked once the lock is retaken
+            // along with any span mapped for the arena concurrently
+            spin_unlock(&g_Free_Bucket_Mutexes[bucket_i][arena_i]);
+            header = mmap_bucket(bucket_i, arena_i, 0);
+            if (header) {
+                push_new_span(bucket_i, arena_i, header);
+            }
+            else {
+                exhausted = 0x01;
+            }
+            spin_lock(&g_Free_Bucket_Mutexes[bucket_i][arena_i]);
+            link_new_spans(bucket_i, arena_i);
+
+            // other threads may have taken slots in the meantime, so
+            // search again from the front where new spans are linked
+            header = g_Bucket_Stacks[bucket_i][arena_i];
+            continue;
+        }
+
+        // modify the header bitmap
+        header->last_offset = offset;
+
+        // a randomized pop takes any free slot near the one found, the
+        // next pop starts from the same place so pops are not ordered
+        if (g_Hardened & XMALLOC_HARDEN_RANDOM) {
+            header->last_offset = (offset + bitmap_size - 1) % bitmap_size;
+            bitmap_shift = random_slot(bucket_i, header->bitmap[bitmap_i], bitmap_shift, bitmap_size - bitmap_i * 64 < 64 ? bitmap_size - bitmap_i * 64 : 64);
+            offset = bitmap_i * 64 + bitmap_shift;
+        }
+
+        header->bitmap[bitmap_i] = header->bitmap[bitmap_i] | (c_64_MSB_High >> bitmap_shift);
+        header->used++;
+
+        // add the offset position to the list
+        void* ptr = ((void*)header) + c_Span_Data_Offset + header->color + (offset * c_Bucket_Sizes[bucket_i]);
+        *((void**)ptr) = *list;
+        *list = ptr;
+        popped++;
+    }
+
+    // unlock the arenas stack, the favorite unless a span was stolen
+    spin_unlock(&g_Free_Bucket_Mutexes[bucket_i][arena_i]);
+    
+    return popped;
+}
+
+// pushes a bucket back onto the stack for the given arena, a span
+// left with no slots in use is unlinked and its units returned to the
+// chunk pool unless it is the only span in the arena stack
+static void push_bucket(int bucket_i, int arena_i, page_header* header, void* addr) {
+    assert(bucket_i >= 0 && bucket_i < BUCKET_NUM);
+
+    // set the offset, get the bitmap index and shift
+    uint32_t offset = (uint32_t)(((uint64_t)addr - (uint64_t)header - c_Span_Data_Offset - header->color) / c_Bucket_Sizes[bucket_i]);
+    uint16_t bitmap_i = offset / (sizeof(uint64_t) * 0x08);
+    uint8_t bitmap_shift = offset % (sizeof(uint64_t) * 0x08);
+    uint8_t release = 0x00;
+
+    // lock the arenas stack
+    spin_lock(&g_Free_Bucket_Mutexes[bucket_i][arena_i]);
+
+    // a rebalance may have moved the span to another arena before the
+    // lock was taken, follow it
+    while (__atomic_load_n(&header->arena, __ATOMIC_RELAXED) != arena_i) {
+        spin_unlock(&g_Free_Bucket_Mutexes[bucket_i][arena_i]);
+        arena_i = __atomic_load_n(&header->arena, __ATOMIC_RELAXED);
+        spin_lock(&g_Free_Bucket_Mutexes[bucket_i][arena_i]);
+    }
+    
+    // update the bitmap
+    header->bitmap[bitmap_i] = header->bitmap[bitmap_i] & ~(c_64_MSB_High >> bitmap_shift);
+    header->used--;
+
+    // unlink an empty span from the stack if other spans remain,
+    // otherwise remember the slot to be reused first
+    if (header->used == 0x00 && (header->prev_page || header->next_page)) {
+        forget_hot_slots(bucket_i, arena_i, header);
+        if (header->prev_page) {
+            header->prev_page->next_page = header->next_page;
+        }
+        else {
+            g_Bucket_Stacks[bucket_i][arena_i] = header->next_page;
+        }
+        if (header->next_page) {
+            header->next_page->prev_page = header->prev_page;
+        }
+        release = 0x01;
+    }
+    else {
+        push_hot_slot(bucket_i, arena_i, header, offset);
+    }
+
+    // unlock the arenas stack
+    spin_unlock(&g_Free_Bucket_Mutexes[bucket_i][arena_i]);
+
+    // the span is no longer reachable, so it is pooled outside the lock
+    if (release) {
+        release_span(header);
+    }
+}
+
+
+
+// --------- TRANSFER CACHE FUNCTIONS -------------------------------
+
+
+
+// pushes every object of a list back onto the arena stacks
+static void push_bucket_list(int bucket_i, void* list) {
+    void* ptr;
+
+    while (list) {
+        ptr = list;
+        list = *((void**)ptr);
+
+        page_header* header = (page_header*)get_page_map(ptr);
+        push_bucket(bucket_i, header->arena, header, ptr);
+    }
+}
+
+// inserts a batch of CACHE_BATCH objects into a transfer cache, the
+// number of batches is bounded by bytes, returns 0 if it is full
+static int transfer_insert(int bucket_i, void* batch) {
+    transfer_cache* transfer = &g_Transfer_Caches[bucket_i];
+    uint32_t max_batches = c_Transfer_Max_Bytes / ((size_t)CACHE_BATCH * c_Bucket_Sizes[bucket_i]);
+    int inserted = 0;
+
+    if (max_batches > TRANSFER_BATCHES) {
+        max_batches = TRANSFER_BATCHES;
+    }
+
+    spin_lock(&transfer->mutex);
+    if (transfer->count < max_batches) {
+        transfer->batches[transfer->count++] = batch;
+        inserted = 1;
+    }
+    spin_unlock(&transfer->mutex);
+
+    return inserted;
+}
+
+// removes a batch of CACHE_BATCH objects from a transfer cache, returns
+// null if it is empty
+static void* transfer_remove(int bucket_i) {
+    transfer_cache* transfer = &g_Transfer_Caches[bucket_i];
+    void* batch = 0;
+
+    // skip the lock when the cache looks empty
+    if (!__atomic_load_n(&transfer->count, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    spin_lock(&transfer->mutex);
+    if (transfer->count) {
+        batch = transfer->batches[--transfer->count];
+    }
+    spin_unlock(&transfer->mutex);
+
+    return batch;
+}
+
+// pushes every batch of every transfer cache back onto the arena stacks
+static void drain_transfer_caches(void) {
+    int bucket_i;
+    void* batches[TRANSFER_BATCHES];
+    uint32_t count;
+
+    for (bucket_i = 0; bucket_i < BUCKET_NUM; bucket_i++) {
+        transfer_cache* transfer = &g_Transfer_Caches[bucket_i];
+
+        spin_lock(&transfer->mutex);
+        count = transfer->count;
+        memcpy(batches, transfer->batches, count * sizeof(void*));
+        transfer->count = 0;
+        spin_unlock(&transfer->mutex);
+
+        while (count) {
+            push_bucket_list(bucket_i, batches[--count]);
+        }
+    }
+}
+
+
+
+// --------- THREAD CACHE FUNCTIONS ---------------------------------
+
+
+
+// detaches a number of objects from the front of a list, returns the
+// rest of the list
+static void* split_list(void* list, uint32_t num) {
+    void* last = list;
+    void* rest;
+
+    while (--num) {
+        last = *((void**)last);
+    }
+    rest = *((void**)last);
+    *((void**)last) = 0;
+
+    return rest;
+}
+
+// flushes a list of a number of objects from a cache, full batches go
+// to the transfer cache and the rest back to the arena stacks
+static void flush_list(int bucket_i, void* list, uint32_t num) {
+    void* batch;
+
+    // move full batches to the transfer cache
+    while (num >= CACHE_BATCH) {
+        batch = list;
+        list = split_list(batch, CACHE_BATCH);
+        num -= CACHE_BATCH;
+
+        if (!transfer_insert(bucket_i, batch)) {
+            push_bucket_list(bucket_i, batch);
+        }
+    }
+
+    // push the rest back onto the arena stacks
+    push_bucket_list(bucket_i, list);
+}
+
+// flushes objects from the front of a thread cache until only a number
+// of objects are left
+static void flush_cache(int bucket_i, uint32_t keep) {
+    bucket_cache* cache = &t_Bucket_Caches[bucket_i];
+    void* list;
+
+    if (cache->count > keep) {
+        list = cache->head;
+        cache->head = split_list(list, cache->count - keep);
+        flush_list(bucket_i, list, cache->count - keep);
+        cache->count = keep;
+    }
+}
+
+// changes the capacity of a thread cache, growth is limited by the
+// per bucket and global capacity maximums, objects past the new
+// capacity are flushed
+static void resize_cache(int bucket_i, uint32_t capacity) {
+    bucket_cache* cache = &t_Bucket_Caches[bucket_i];
+    uint32_t max_capacity = c_Cache_Max_Bytes / c_Bucket_Sizes[bucket_i];
+    size_t size = c_Bucket_Sizes[bucket_i];
+
+    if (max_capacity > CACHE_MAX_OBJECTS) {
+        max_capacity = CACHE_MAX_OBJECTS;
+    }
+    if (capacity > max_capacity) {
+        capacity = max_capacity;
+    }
+
+    if (capacity > cache->capacity) {
+        // only grow while all caches stay under the global maximum
+        size_t grow_bytes = (capacity - cache->capacity) * size;
+        if (__atomic_add_fetch(&g_Cache_Capacity_Bytes, grow_bytes, __ATOMIC_RELAXED) > c_Cache_Global_Max_Bytes) {
+            __atomic_sub_fetch(&g_Cache_Capacity_Bytes, grow_bytes, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    else {
+        __atomic_sub_fetch(&g_Cache_Capacity_Bytes, (cache->capacity - capacity) * size, __ATOMIC_RELAXED);
+    }
+
+    cache->capacity = capacity;
+    flush_cache(bucket_i, capacity);
+}
+
+// flushes every thread cache of the calling thread and releases their
+// capacity
+static void flush_all_caches(void) {
+    int bucket_i;
+
+    for (bucket_i = 0; bucket_i < BUCKET_NUM; bucket_i++) {
+        resize_cache(bucket_i, 0);
+        t_Bucket_Caches[bucket_i].misses = 0;
+    }
+}
+
+// called when a thread with caches exits
+static void flush_thread_caches(void* arg) {
+    (void)arg;
+    flush_all_caches();
+}
+
+// the garbage collection tick, buckets that did not miss since the last
+// tick are idle and their caches shrink by a quarter
+static void tick_caches(void) {
+    int bucket_i;
+    bucket_cache* cache;
+
+    for (bucket_i = 0; bucket_i < BUCKET_NUM; bucket_i++) {
+        cache = &t_Bucket_Caches[bucket_i];
+        if (!cache->misses && cache->capacity) {
+            resize_cache(bucket_i, cache->capacity - (cache->capacity + 3) / 4);
+        }
+        cache->misses = 0;
+    }
+}
+
+// checks a thread's caches are registered to be flushed when it exits
+// and flushes them if a purge asked every thread to
+static void check_caches(void) {
+    uint32_t epoch = __atomic_load_n(&g_Cache_Epoch, __ATOMIC_RELAXED);
+
+    if (!t_Cache_Registered && __atomic_load_n(&g_Cache_Key_Ready, __ATOMIC_ACQUIRE)) {
+        t_Cache_Registered = 0x01;
+        t_Cache_Epoch = epoch;
+        pthread_setspecific(g_Cache_Key, (void*)0x1);
+    }
+
+    if (t_Cache_Epoch != epoch) {
+        t_Cache_Epoch = epoch;
+        flush_all_caches();
+    }
+}
+
+// xmallocs a bucket from the thread cache, a miss grows the cache
+// capacity and refills it with a batch from the transfer cache, or the
+// arena stacks if it has none, returns null if no memory is left
+static void* cache_pop(int bucket_i) {
+    bucket_cache* cache = &t_Bucket_Caches[bucket_i];
+    void* ptr;
+
+    check_caches();
+
+    // run the garbage collection tick every so many allocations
+    if (!t_Cache_Ticks--) {
+        t_Cache_Ticks = c_Cache_Tick_Allocs;
+        tick_caches();
+    }
+
+    // a hit pops the cache
+    if (cache->head) {
+        ptr = cache->head;
+        cache->head = *((void**)ptr);
+        cache->count--;
+        return ptr;
+    }
+
+    // a miss grows the capacity by half (at least 2) and refills
+    cache->misses++;
+    resize_cache(bucket_i, cache->capacity + (cache->capacity / 2 > 2 ? cache->capacity / 2 : 2));
+
+    // only a full batch is taken from the transfer cache
+    uint32_t num = cache->capacity < CACHE_BATCH ? cache->capacity : CACHE_BATCH;
+    if (num != CACHE_BATCH || !(ptr = transfer_remove(bucket_i))) {
+        num = pop_buckets(bucket_i, num ? num : 1, &ptr);
+        if (!num) {
+            return 0;
+        }
+    }
+
+    // return the first object and cache the rest
+    cache->head = *((void**)ptr);
+    cache->count = num - 1;
+    return ptr;
+}
+
+// xfrees a bucket into the thread cache, a full cache flushes half of
+// its objects back to the arena stacks
+static void cache_push(int bucket_i, void* ptr) {
+    bucket_cache* cache = &t_Bucket_Caches[bucket_i];
+
+    check_caches();
+
+    if (cache->count >= cache->capacity) {
+        flush_cache(bucket_i, cache->capacity / 2);
+
+        // a cache with no capacity holds nothing
+        if (!cache->capacity) {
+            page_header* header = (page_header*)get_page_map(ptr);
+            push_bucket(bucket_i, header->arena, header, ptr);
+            return;
+        }
+    }
+
+    *((void**)ptr) = cache->head;
+    cache->head = ptr;
+    cache->count++;
+}
+
+
+
+// --------- PER CPU CACHE FUNCTIONS --------------------------------
+
+
+
+#ifdef PERCPU_RSEQ
+
+// gets the cpu the calling thread runs on from its rseq area, the cpu
+// may change right after, -1 if rseq is not registered for the thread
+static int32_t rseq_cpu(void) {
+    return *((volatile int32_t*)(__builtin_thread_pointer() + __rseq_offset + 4));
+}
+
+// pops an object from the bucket cache of the current cpu in an rseq
+// critical section, the kernel restarts the section if the thread is
+// preempted or migrated before the count is committed, returns null if
+// the cache is empty
+static void* percpu_pop(int bucket_i) {
+    uint64_t cache;
+    uint64_t count;
+    void* ptr;
+
+    __asm__ __volatile__ (
+        // the critical section descriptor
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        // register the critical section in rseq_cs
+        "0:\n\t"
+        "leaq 3b(%%rip), %[cache]\n\t"
+        "movq %[cache], %%fs:8(%[rseq])\n\t"
+        // find the cache of the current cpu
+        "1:\n\t"
+        "movl %%fs:4(%[rseq]), %k[cache]\n\t"
+        "imulq %[stride], %[cache], %[cache]\n\t"
+        "addq %[caches], %[cache]\n\t"
+        // pop the top object if the cache is not empty
+        "xorl %k[ptr], %k[ptr]\n\t"
+        "movl (%[cache]), %k[count]\n\t"
+        "testl %k[count], %k[count]\n\t"
+        "jz 2f\n\t"
+        "movq (%[cache], %[count], 8), %[ptr]\n\t"
+        "decl %k[count]\n\t"
+        // commit the new count
+        "movl %k[count], (%[cache])\n\t"
+        "2:\n\t"
+        // the abort handler, preceded by the rseq signature, retries
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".long 0x53053053\n\t"
+        "4:\n\t"
+        "jmp 0b\n\t"
+        ".popsection\n\t"
+        : [cache] "=&r" (cache), [count] "=&r" (count), [ptr] "=&r" (ptr)
+        : [rseq] "r" (__rseq_offset), [stride] "i" (sizeof(percpu_cache) * BUCKET_NUM),
+          [caches] "r" ((uint64_t)(g_Percpu_Caches + bucket_i))
+        : "memory", "cc");
+
+    return ptr;
+}
+
+// pushes an object onto the bucket cache of the current cpu in an rseq
+// critical section, returns 0 if the cache is full
+static int percpu_push(int bucket_i, void* ptr) {
+    uint64_t cache;
+    uint64_t count;
+    uint64_t pushed;
+
+    __asm__ __volatile__ (
+        // the critical section descriptor
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        // register the critical section in rseq_cs
+        "0:\n\t"
+        "leaq 3b(%%rip), %[cache]\n\t"
+        "movq %[cache], %%fs:8(%[rseq])\n\t"
+        // find the cache of the current cpu
+        "1:\n\t"
+        "movl %%fs:4(%[rseq]), %k[cache]\n\t"
+        "imulq %[stride], %[cache], %[cache]\n\t"
+        "addq %[caches], %[cache]\n\t"
+        // push the object if the cache is not full
+        "xorl %k[pushed], %k[pushed]\n\t"
+        "movl (%[cache]), %k[count]\n\t"
+        "cmpl 4(%[cache]), %k[count]\n\t"
+        "jae 2f\n\t"
+        "movq %[ptr], 8(%[cache], %[count], 8)\n\t"
+        "incl %k[count]\n\t"
+        "movl $1, %k[pushed]\n\t"
+        // commit the new count
+        "movl %k[count], (%[cache])\n\t"
+        "2:\n\t"
+        // the abort handler, preceded by the rseq signature, retries
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".long 0x53053053\n\t"
+        "4:\n\t"
+        "jmp 0b\n\t"
+        ".popsection\n\t"
+        : [cache] "=&r" (cache), [count] "=&r" (count), [pushed] "=&r" (pushed)
+        : [rseq] "r" (__rseq_offset), [stride] "i" (sizeof(percpu_cache) * BUCKET_NUM),
+          [caches] "r" ((uint64_t)(g_Percpu_Caches + bucket_i)), [ptr] "r" (ptr)
+        : "memory", "cc");
+
+    return (int)pushed;
+}
+
+#else
+
+static int32_t rseq_cpu(void) {
+    return -1;
+}
+
+static void* percpu_pop(int bucket_i) {
+    (void)bucket_i;
+    return 0;
+}
+
+static int percpu_push(int bucket_i, void* ptr) {
+    (void)bucket_i;
+    (void)ptr;
+    return 0;
+}
+
+#endif
+
+// checks per cpu caches can be used by the calling thread, rseq must be
+// registered and the cpu within the configured cpus
+static int percpu_usable(void) {
+    return g_Percpu_Caches && (uint32_t)rseq_cpu() < g_Percpu_Num;
+}
+
+// pops up to a number of objects from the bucket cache of the cpu the
+// thread runs on into a list, returns the number popped
+static uint32_t percpu_pop_list(int bucket_i, uint32_t num, void** list) {
+    uint32_t popped;
+    void* ptr;
+
+    *list = 0;
+    for (popped = 0; popped < num && (ptr = percpu_pop(bucket_i)); popped++) {
+        *((void**)ptr) = *list;
+        *list = ptr;
+    }
+    return popped;
+}
+
+// xmallocs a bucket from the cache of the current cpu, a miss refills
+// it with a batch from the transfer cache or the arena stacks, returns
+// null if no memory is left
+static void* percpu_cache_pop(int bucket_i) {
+    void* ptr = percpu_pop(bucket_i);
+    void* list;
+    void* rest = 0;
+    uint32_t num;
+
+    if (ptr) {
+        return ptr;
+    }
+
+    // set the capacity of the cache the first time it misses, every
+    // thread writes the same value so no critical section is needed
+    percpu_cache* cache = &g_Percpu_Caches[(uint32_t)rseq_cpu() * BUCKET_NUM + bucket_i];
+    if (!cache->capacity) {
+        num = c_Cache_Max_Bytes / c_Bucket_Sizes[bucket_i];
+        __atomic_store_n(&cache->capacity, num < PERCPU_OBJECTS ? num : PERCPU_OBJECTS, __ATOMIC_RELAXED);
+    }
+
+    // only a full batch is taken from the transfer cache
+    num = __atomic_load_n(&cache->capacity, __ATOMIC_RELAXED);
+    num = num < CACHE_BATCH ? num : CACHE_BATCH;
+    if (num != CACHE_BATCH || !(ptr = transfer_remove(bucket_i))) {
+        num = pop_buckets(bucket_i, num, &ptr);
+        if (!num) {
+            return 0;
+        }
+    }
+
+    // return the first object and cache the rest, objects that no
+    // longer fit (the thread may have moved cpus) are flushed
+    list = *((void**)ptr);
+    num = 0;
+    while (list) {
+        void* next = *((void**)list);
+        if (!percpu_push(bucket_i, list)) {
+            *((void**)list) = rest;
+            rest = list;
+            num++;
+        }
+        list = next;
+    }
+    if (rest) {
+        flush_list(bucket_i, rest, num);
+    }
+
+    return ptr;
+}
+
+// xfrees a bucket into the cache of the current cpu, a full cache
+// flushes half of its objects
+static void percpu_cache_push(int bucket_i, void* ptr) {
+    void* list;
+    uint32_t num;
+
+    while (!percpu_push(bucket_i, ptr)) {
+        percpu_cache* cache = &g_Percpu_Caches[(uint32_t)rseq_cpu() * BUCKET_NUM + bucket_i];
+        num = __atomic_load_n(&cache->capacity, __ATOMIC_RELAXED);
+
+        // a cache that never missed has no capacity yet
+        if (!num) {
+            page_header* header = (page_header*)get_page_map(ptr);
+            push_bucket(bucket_i, header->arena, header, ptr);
+            return;
+        }
+
+        num = percpu_pop_list(bucket_i, num / 2 + 1, &list);
+        if (num) {
+            flush_list(bucket_i, list, num);
+        }
+    }
+}
+
+// the thread draining the per cpu caches for a purge, it moves itself
+// to each configured cpu in turn since a cpu's cache is only changed
+// from that cpu, cpus the process may not run on are skipped
+static void* percpu_drainer(void* arg) {
+    (void)arg;
+    cpu_set_t single;
+    uint32_t cpu;
+    int bucket_i;
+    void* list;
+    uint32_t num;
+
+    for (cpu = 0; cpu < g_Percpu_Num && cpu < CPU_SETSIZE; cpu++) {
+        CPU_ZERO(&single);
+        CPU_SET(cpu, &single);
+        if (sched_setaffinity(0, sizeof(single), &single)) {
+            continue;
+        }
+
+        // drain whichever cpu the thread is on, normally the one set
+        for (bucket_i = 0; bucket_i < BUCKET_NUM; bucket_i++) {
+            while ((num = percpu_pop_list(bucket_i, CACHE_BATCH, &list))) {
+                flush_list(bucket_i, list, num);
+            }
+        }
+    }
+
+    return 0;
+}
+
+// flushes the per cpu caches of every cpu the process may run on from a
+// short lived helper thread, so the affinity of the purging thread is
+// never changed, the caches are left as they are if no thread can be
+// created
+static void drain_percpu_caches(void) {
+    pthread_t drainer;
+
+    if (!g_Percpu_Caches || pthread_create(&drainer, 0, percpu_drainer, 0)) {
+        return;
+    }
+    pthread_join(drainer, 0);
+}
+
+// mmaps the per cpu caches if rseq is registered by glibc and per cpu
+// caches are not disabled by XMALLOC_PERCPU=0
+static void initialize_percpu_caches(void) {
+#ifdef PERCPU_RSEQ
+    char* percpu = getenv("XMALLOC_PERCPU");
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+
+    if ((percpu && percpu[0] == '0') || !&__rseq_size || !&__rseq_offset || __rseq_size < 20 || cpus <= 0 || rseq_cpu() < 0) {
+        return;
+    }
+
+    size_t size = (size_t)cpus * BUCKET_NUM * sizeof(percpu_cache);
+    void* caches = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (caches == MAP_FAILED) {
+        return;
+    }
+
+    g_Percpu_Num = (uint32_t)cpus;
+    g_Percpu_Caches = caches;
+#endif
+}
+
+
+
+// --------- OWNED SPAN FUNCTIONS -----------------------------------
+
+
+
+// links a span at the head or tail of a thread's owned list
+static void owned_link(owned_list* list, page_header* header, int at_head) {
+    if (at_head) {
+        header->prev_page = 0;
+        header->next_page = list->head;
+        if (list->head) {
+            list->head->prev_page = header;
+        }
+        else {
+            list->tail = header;
+        }
+        list->head = header;
+    }
+    else {
+        header->next_page = 0;
+        header->prev_page = list->tail;
+        if (list->tail) {
+            list->tail->next_page = header;
+        }
+        else {
+            list->head = header;
+        }
+        list->tail = header;
+    }
+}
+
+// unlinks a span from a thread's owned list
+static void owned_unlink(owned_list* list, page_header* header) {
+    if (header->prev_page) {
+        header->prev_page->next_page = header->next_page;
+    }
+    else {
+        list->head = header->next_page;
+    }
+    if (header->next_page) {
+        header->next_page->prev_page = header->prev_page;
+    }
+    else {
+        list->tail = header->prev_page;
+    }
+}
+
+// moves the slots other threads freed onto a span to its local free
+// list, only the owner (or the holder of the abandoned lock) may
+static void collect_thread_free(page_header* header) {
+    void* list = __atomic_exchange_n(&header->thread_free, 0, __ATOMIC_ACQUIRE);
+    void* last = list;
+    uint32_t num = 1;
+
+    if (!list) {
+        return;
+    }
+
+    while (*((void**)last)) {
+        last = *((void**)last);
+        num++;
+    }
+
+    *((void**)last) = header->local_free;
+    header->local_free = list;
+    header->used -= num;
+}
+
+// carves the next c_Owned_Carve_Bytes of never used slots of a span
+// (at least one) into its local free list in address order, returns 0
+// if every slot was already carved
+static int carve_slots(page_header* header) {
+    uint32_t size = c_Bucket_Sizes[header->bucket];
+    uint32_t slots = g_Bucket_Slots[header->bucket];
+    uint32_t num = c_Owned_Carve_Bytes / size;
+    uint32_t slot_i;
+
+    if (header->carved >= slots) {
+        return 0;
+    }
+
+    num = num ? num : 1;
+    num = num < slots - header->carved ? num : slots - header->carved;
+
+    void* first = (void*)header + c_Span_Data_Offset + header->color + (size_t)header->carved * size;
+    for (slot_i = num; slot_i-- > 0;) {
+        void* slot = first + (size_t)slot_i * size;
+        *((void**)slot) = header->local_free;
+        header->local_free = slot;
+    }
+    header->carved += num;
+
+    return 1;
+}
+
+// gives a span owned by this thread free slots to pop from its local
+// list, from other threads' frees or its uncarved slots, returns 0 if
+// every slot is in use
+static int refill_owned_span(page_header* header) {
+    if (header->local_free) {
+        return 1;
+    }
+
+    collect_thread_free(header);
+    return header->local_free || carve_slots(header);
+}
+
+// abandons the owned spans of an exiting thread, the key destructor,
+// spans with no slots in use are released and the others are left for
+// another thread to adopt, frees to them meanwhile go to their thread
+// free lists
+static void abandon_owned_spans(void* arg) {
+    int bucket_i;
+    page_header* header;
+    page_header* next;
+
+    (void)arg;
+
+    for (bucket_i = 0; bucket_i < BUCKET_NUM; bucket_i++) {
+        owned_list* list = &t_Owned_Spans[bucket_i];
+
+        for (header = list->head; header; header = next) {
+            next = header->next_page;
+
+            collect_thread_free(header);
+            if (!header->used) {
+                release_span(header);
+                continue;
+            }
+
+            __atomic_store_n(&header->owner, 0, __ATOMIC_RELEASE);
+
+            spin_lock(&g_Abandoned_Mutexes[bucket_i]);
+            header->prev_page = 0;
+            header->next_page = g_Abandoned_Spans[bucket_i];
+            g_Abandoned_Spans[bucket_i] = header;
+            spin_unlock(&g_Abandoned_Mutexes[bucket_i]);
+        }
+
+        list->head = 0;
+        list->tail = 0;
+        list->empty = 0;
+    }
+
+    // a thread allocating again after this registers again
+    t_Owned_Registered = 0x00;
+}
+
+// takes a span abandoned by an exited thread for this thread, returns
+// null if the bucket has none
+static page_header* adopt_span(int bucket_i) {
+    page_header* header;
+
+    if (!__atomic_load_n(&g_Abandoned_Spans[bucket_i], __ATOMIC_RELAXED)) {
+        return 0;
+    }
+
+    spin_lock(&g_Abandoned_Mutexes[bucket_i]);
+    header = g_Abandoned_Spans[bucket_i];
+    if (header) {
+        g_Abandoned_Spans[bucket_i] = header->next_page;
+    }
+    spin_unlock(&g_Abandoned_Mutexes[bucket_i]);
+
+    if (header) {
+        __atomic_store_n(&header->owner, t_Owner_Id, __ATOMIC_RELAXED);
+    }
+    return header;
+}
+
+// releases the abandoned spans whose slots other threads have all
+// freed, returns the number of bytes released
+static size_t purge_abandoned_spans(void) {
+    int bucket_i;
+    page_header* header;
+    page_header* next;
+    page_header** link;
+    page_header* empty;
+    size_t purged = 0x00;
+
+    for (bucket_i = 0; bucket_i < BUCKET_NUM; bucket_i++) {
+        if (!__atomic_load_n(&g_Abandoned_Spans[bucket_i], __ATOMIC_RELAXED)) {
+            continue;
+        }
+        empty = 0;
+
+        spin_lock(&g_Abandoned_Mutexes[bucket_i]);
+        link = &g_Abandoned_Spans[bucket_i];
+        while (*link) {
+            header = *link;
+            collect_thread_free(header);
+            if (header->used) {
+                link = &header->next_page;
+                continue;
+            }
+
+            *link = header->next_page;
+            header->next_page = empty;
+            empty = header;
+        }
+        spin_unlock(&g_Abandoned_Mutexes[bucket_i]);
+
+        for (header = empty; header; header = next) {
+            next = header->next_page;
+            purged += (size_t)header->units * SPAN_UNIT;
+            release_span(header);
+        }
+    }
+
+    return purged;
+}
+
+// xmallocs a bucket when the thread's current span has no free slot,
+// the current span is refilled, then up to c_Owned_Scan other owned
+// spans are checked (full ones rotate to the tail), then abandoned
+// spans are adopted and lastly a new span is taken, returns null if no
+// memory is left
+static void* owned_pop_slow(int bucket_i) {
+    owned_list* list = &t_Owned_Spans[bucket_i];
+    page_header* header = list->head;
+    uint32_t scanned;
+    void* ptr;
+
+    // take an owner id and abandon the spans on exit
+    if (!t_Owner_Id) {
+        t_Owner_Id = __atomic_add_fetch(&g_Owner_Ids, 1, __ATOMIC_RELAXED);
+    }
+    if (!t_Owned_Registered) {
+        t_Owned_Registered = 0x01;
+        pthread_setspecific(g_Owned_Key, (void*)0x1);
+    }
+
+    if (!header || !refill_owned_span(header)) {
+        header = 0;
+        for (scanned = 0; list->head != list->tail && scanned < c_Owned_Scan; scanned++) {
+            page_header* full = list->head;
+            owned_unlink(list, full);
+            owned_link(list, full, 0);
+
+            // an empty span kept for reuse becomes the current span
+            if (!list->head->used) {
+                list->empty--;
+            }
+            if (refill_owned_span(list->head)) {
+                header = list->head;
+                break;
+            }
+        }
+    }
+
+    // adopted spans that are still full stay owned by this thread
+    while (!header && (header = adopt_span(bucket_i))) {
+        owned_link(list, header, 1);
+        if (!refill_owned_span(header)) {
+            header = 0;
+        }
+    }
+
+    if (!header) {
+        header = mmap_bucket(bucket_i, 0, t_Owner_Id);
+        if (!header) {
+            return 0;
+        }
+
+        owned_link(list, header, 1);
+        carve_slots(header);
+    }
+
+    ptr = header->local_free;
+    header->local_free = *((void**)ptr);
+    header->used++;
+    return ptr;
+}
+
+// xmallocs a bucket from the local free list of the thread's current
+// span, without atomics or shared writes
+static inline void* owned_pop(int bucket_i) {
+    page_header* header = t_Owned_Spans[bucket_i].head;
+    void* ptr;
+
+    if (header && (ptr = header->local_free)) {
+        header->local_free = *((void**)ptr);
+        header->used++;
+        return ptr;
+    }
+
+    return owned_pop_slow(bucket_i);
+}
+
+// a span of the thread has no slots in use, one such span past the
+// current span is kept for reuse and the others are released
+static __attribute__ ((noinline)) void owned_span_empty(page_header* header) {
+    owned_list* list = &t_Owned_Spans[header->bucket];
+
+    if (header == list->head) {
+        return;
+    }
+
+    if (list->empty < c_Owned_Empty_Spans) {
+        list->empty++;
+        return;
+    }
+
+    owned_unlink(list, header);
+    release_span(header);
+}
+
+// xfrees a bucket of a thread owned span, the owner pushes it onto the
+// local free list and any other thread onto the thread free list with a
+// compare and swap, which the owner collects once its span runs out
+static inline void owned_push(page_header* header, void* ptr) {
+    uint32_t owner = __atomic_load_n(&header->owner, __ATOMIC_RELAXED);
+
+    if (owner && owner == t_Owner_Id) {
+        *((void**)ptr) = header->local_free;
+        header->local_free = ptr;
+        if (!--header->used) {
+            owned_span_empty(header);
+        }
+        return;
+    }
+
+    void* head = __atomic_load_n(&header->thread_free, __ATOMIC_RELAXED);
+    do {
+        *((void**)ptr) = head;
+    } while (!__atomic_compare_exchange_n(&header->thread_free, &head, ptr, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+
+// --------- PURGE FUNCTIONS ----------------------------------------
+
+
+
+// checks if the slots first to last (inclusive) of a span are all free
+static int slots_free(page_header* header, uint32_t first, uint32_t last) {
+    uint16_t bitmap_i;
+    uint64_t mask;
+
+    for (bitmap_i = first / 64; bitmap_i <= last / 64; bitmap_i++) {
+        // mask the bits of the range within this index of the bitmap
+        mask = c_64_All_High;
+        if (bitmap_i == first / 64) {
+            mask &= c_64_All_High >> (first % 64);
+        }
+        if (bitmap_i == last / 64) {
+            mask &= c_64_All_High << (63 - (last % 64));
+        }
+
+        if (header->bitmap[bitmap_i] & mask) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// madvises every page of a span without header data whose slots are
+// all free as DONTNEED, the arena mutex of the span must be held,
+// returns the number of bytes madvised
+static size_t purge_span_pages(page_header* header) {
+    uint32_t slot_size = c_Bucket_Sizes[header->bucket];
+    uint32_t slots = ((header->units * SPAN_UNIT) - c_Span_Data_Offset) / slot_size;
+    size_t data_offset = c_Span_Data_Offset + header->color;
+    size_t span_size = (size_t)header->units * SPAN_UNIT;
+    size_t run_start = 0x00;
+    size_t purged = 0x00;
+    size_t page;
+    uint32_t first;
+    uint32_t last;
+
+    // the first page holds the header so it is never purged, a page
+    // past the page loop ends any run of free pages
+    for (page = SMALL_PAGE; page <= span_size; page += SMALL_PAGE) {
+        int page_free = 0;
+
+        // pages before the first slot (behind a large color) are free
+        if (page < span_size && page + SMALL_PAGE <= data_offset) {
+            page_free = 1;
+        }
+        else if (page < span_size) {
+            // find the slots overlapping the page, pages past the last
+            // slot are always free
+            first = page < data_offset ? 0 : (page - data_offset) / slot_size;
+            last = (page + SMALL_PAGE - 1 - data_offset) / slot_size;
+            last = last < slots ? last : slots - 1;
+            page_free = first >= slots || slots_free(header, first, last);
+        }
+
+        // start or extend a run of free pages
+        if (page_free) {
+            if (!run_start) {
+                run_start = page;
+            }
+            continue;
+        }
+
+        // madvise the run ended by this page, a failed madvise only
+        // leaves the pages resident
+        if (run_start) {
+            if (!madvise((void*)header + run_start, page - run_start, MADV_DONTNEED)) {
+                purged += page - run_start;
+            }
+            run_start = 0x00;
+        }
+    }
+
+    return purged;
+}
+
+// purges free memory back to the operating system, thread caches are
+// flushed (other threads flush on their next allocation or free), empty
+// spans (even the last one in an arena) are released, free pages within
+// spans are madvised as DONTNEED and chunks with no spans are
+// munmapped, returns the number of bytes released
+size_t xmalloc_purge(void) {
+    int bucket_i;
+    int arena_i;
+    page_header* header;
+    page_header* next;
+    page_header* empty;
+    chunk_header* chunk;
+    chunk_header** link;
+    chunk_header* unmapped = 0;
+    size_t purged = 0x00;
+
+    // only one thread purges at a time, the others carry on allocating
+    if (pthread_mutex_trylock(&g_Purge_Mutex)) {
+        return 0x00;
+    }
+
+    // ask every thread to flush its caches and flush this thread's now
+    __atomic_add_fetch(&g_Cache_Epoch, 1, __ATOMIC_RELAXED);
+    if (t_Cache_Registered) {
+        t_Cache_Epoch = __atomic_load_n(&g_Cache_Epoch, __ATOMIC_RELAXED);
+        flush_all_caches();
+    }
+    drain_percpu_caches();
+    drain_transfer_caches();
+    purged += purge_abandoned_spans();
+
+    for (bucket_i = 0; bucket_i < BUCKET_NUM; bucket_i++) {
+        for (arena_i = 0; arena_i < ARENA_NUM; arena_i++) {
+            empty = 0;
+
+            spin_lock(&g_Free_Bucket_Mutexes[bucket_i][arena_i]);
+            link_new_spans(bucket_i, arena_i);
+
+            // unlink empty spans onto a local list and purge the pages
+            // of the others
+            for (header = g_Bucket_Stacks[bucket_i][arena_i]; header; header = next) {
+                next = header->next_page;
+
+                if (header->used != 0x00) {
+                    purged += purge_span_pages(header);
+                    continue;
+                }
+
+                if (header->prev_page) {
+                    header->prev_page->next_page = header->next_page;
+                }
+                else {
+                    g_Bucket_Stacks[bucket_i][arena_i] = header->next_page;
+                }
+                if (header->next_page) {
+                    header->next_page->prev_page = header->prev_page;
+                }
+                forget_hot_slots(bucket_i, arena_i, header);
+                header->next_page = empty;
+                empty = header;
+            }
+
+            spin_unlock(&g_Free_Bucket_Mutexes[bucket_i][arena_i]);
+
+            // release the empty spans outside the lock
+            for (header = empty; header; header = next) {
+                next = header->next_page;
+                purged += (size_t)header->units * SPAN_UNIT;
+                release_span(header);
+            }
+        }
+    }
+
+    // unlink chunks that have every unit free, no span can be taken
+    // from them once unlinked so they are munmapped with the pool
+    // unlocked
+    pthread_mutex_lock(&g_Chunk_Pool_Mutex);
+    link = &g_Chunks;
+    while (*link) {
+        chunk = *link;
+
+        // chunks committed from the reserved address space stay, their
+        // spans were madvised when released
+        if (chunk->free_units != c_Chunk_All_Free || in_reserve(chunk->base)) {
+            link = &chunk->next_chunk;
+            continue;
+        }
+
+        *link = chunk->next_chunk;
+        chunk->next_chunk = unmapped;
+        unmapped = chunk;
+    }
+    pthread_mutex_unlock(&g_Chunk_Pool_Mutex);
+
+    if (unmapped) {
+        // a failed munmap only leaks the address space of the chunk,
+        // its spans were madvised when released
+        for (chunk = unmapped; chunk; chunk = chunk->next_chunk) {
+            munmap(chunk->base, ALLOC_CHUNK);
+        }
+
+        // the headers are reused for the next chunks mmapped
+        pthread_mutex_lock(&g_Chunk_Pool_Mutex);
+        for (chunk = unmapped; chunk->next_chunk; chunk = chunk->next_chunk);
+        chunk->next_chunk = g_Free_Chunk_Headers;
+        g_Free_Chunk_Headers = unmapped;
+        pthread_mutex_unlock(&g_Chunk_Pool_Mutex);
+    }
+
+    __atomic_store_n(&g_Purged_Heap_Bytes, __atomic_load_n(&g_Heap_Bytes, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&g_Purge_Mutex);
+
+    return purged;
+}
+
+// sets the soft and hard heap limits in bytes, 0 is no limit
+void xmalloc_set_limits(size_t soft_bytes, size_t hard_bytes) {
+    __atomic_store_n(&g_Soft_Limit, soft_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_Hard_Limit, hard_bytes, __ATOMIC_RELAXED);
+}
+
+// gets the number of bytes in spans and non bucket mmaps
+size_t xmalloc_heap_bytes(void) {
+    return __atomic_load_n(&g_Heap_Bytes, __ATOMIC_RELAXED);
+}
+
+
+
+// --------- MEMORY PRESSURE FUNCTIONS ------------------------------
+
+
+
+// reads a cgroup file into a buffer as a null terminated string, files
+// are read with plain syscalls so the watcher never allocates, returns
+// 0 if the file cannot be read
+static int read_cgroup_file(const char* cgroup_dir, const char* name, char* buffer, size_t buffer_size) {
+    char path[CGROUP_PATH_MAX];
+    ssize_t bytes;
+
+    if (snprintf(path, sizeof(path), "%s/%s", cgroup_dir, name) >= (int)sizeof(path)) {
+        return 0;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    bytes = read(fd, buffer, buffer_size - 1);
+    close(fd);
+
+    if (bytes <= 0) {
+        return 0;
+    }
+    buffer[bytes] = '\0';
+    return 1;
+}
+
+// reads a cgroup memory file holding a byte count, returns 0 if the file
+// is missing or holds 'max' (no limit)
+static uint64_t read_cgroup_bytes(const char* cgroup_dir, const char* name) {
+    char buffer[64];
+
+    if (!read_cgroup_file(cgroup_dir, name, buffer, sizeof(buffer)) || buffer[0] < '0' || buffer[0] > '9') {
+        return 0x00;
+    }
+    return strtoull(buffer, 0, 10);
+}
+
+// reads the PSI 'some avg10' stall of a cgroup memory.pressure file in
+// hundredths of a percent, returns 0 if the file is missing
+static uint32_t read_cgroup_stall(const char* cgroup_dir) {
+    char buffer[256];
+    char* avg10;
+    char* end;
+
+    if (!read_cgroup_file(cgroup_dir, "memory.pressure", buffer, sizeof(buffer))) {
+        return 0x00;
+    }
+
+    // the first line is 'some avg10=X.YY avg60=X.YY avg300=X.YY total=N'
+    avg10 = strstr(buffer, "some avg10=");
+    if (!avg10) {
+        return 0x00;
+    }
+    avg10 += strlen("some avg10=");
+
+    uint32_t stall = (uint32_t)strtoul(avg10, &end, 10) * 100;
+    if (*end == '.' && end[1] >= '0' && end[1] <= '9') {
+        stall += (end[1] - '0') * 10;
+        if (end[2] >= '0' && end[2] <= '9') {
+            stall += end[2] - '0';
+        }
+    }
+    return stall;
+}
+
+// polls the cgroup v2 memory files in a directory once and purges free
+// memory if the cgroup is under pressure, either its usage is close to
+// its limit or PSI reports memory stalls, returns 1 if it purged
+// memory.current counts the page cache, which a purge cannot release,
+// so while the pressure lasts a poll only purges again once the heap
+// has grown by a chunk since the last purge
+int xmalloc_pressure_poll(const char* cgroup_dir) {
+    if (!cgroup_dir) {
+        cgroup_dir = "/sys/fs/cgroup";
+    }
+
+    uint64_t current = read_cgroup_bytes(cgroup_dir, "memory.current");
+    uint64_t limit = read_cgroup_bytes(cgroup_dir, "memory.high");
+    if (!limit) {
+        limit = read_cgroup_bytes(cgroup_dir, "memory.max");
+    }
+
+    // check usage against the limit and the stall against the threshold
+    if (!(limit && current * 100 >= limit * c_Pressure_Usage_Percent) && read_cgroup_stall(cgroup_dir) < c_Pressure_Stall_Hundredths) {
+        __atomic_store_n(&g_Pressure_Purged, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    // the last purge under this pressure left nothing new to release
+    if (__atomic_load_n(&g_Pressure_Purged, __ATOMIC_RELAXED) && __atomic_load_n(&g_Heap_Bytes, __ATOMIC_RELAXED) <= __atomic_load_n(&g_Purged_Heap_Bytes, __ATOMIC_RELAXED) + ALLOC_CHUNK) {
+        return 0;
+    }
+
+    xmalloc_purge();
+    __atomic_store_n(&g_Pressure_Purged, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// the pressure watcher thread, polls until asked to stop, it waits out
+// each interval on the stop flag's futex so a stop wakes it at once
+static void* pressure_watcher(void* arg) {
+    (void)arg;
+    struct timespec interval;
+
+    interval.tv_sec = g_Pressure_Interval_Ms / 1000;
+    interval.tv_nsec = (long)(g_Pressure_Interval_Ms % 1000) * 1000000;
+
+    while (!__atomic_load_n(&g_Pressure_Stop, __ATOMIC_ACQUIRE)) {
+        xmalloc_pressure_poll(g_Pressure_Cgroup);
+        syscall(SYS_futex, &g_Pressure_Stop, FUTEX_WAIT_PRIVATE, 0, &interval, 0, 0);
+    }
+    return 0;
+}
+
+// starts a thread that polls the cgroup v2 memory files in a directory
+// (/sys/fs/cgroup if null) every interval milliseconds (a default
+// interval if 0) and purges under pressure, returns 0 on success
+int xmalloc_pressure_start(const char* cgroup_dir, unsigned interval_ms) {
+    int error = 0;
+
+    if (!cgroup_dir) {
+        cgroup_dir = "/sys/fs/cgroup";
+    }
+    if (strlen(cgroup_dir) >= sizeof(g_Pressure_Cgroup)) {
+        return ENAMETOOLONG;
+    }
+
+    pthread_mutex_lock(&g_Pressure_Mutex);
+
+    // only one watcher runs at a time
+    if (g_Pressure_Running) {
+        pthread_mutex_unlock(&g_Pressure_Mutex);
+        return EBUSY;
+    }
+
+    strcpy(g_Pressure_Cgroup, cgroup_dir);
+    g_Pressure_Interval_Ms = interval_ms ? interval_ms : c_Pressure_Interval_Ms;
+    g_Pressure_Stop = 0;
+
+    error = pthread_create(&g_Pressure_Thread, 0, pressure_watcher, 0);
+    g_Pressure_Running = !error;
+
+    pthread_mutex_unlock(&g_Pressure_Mutex);
+    return error;
+}
+
+// stops the pressure watcher thread and waits for it to exit
+void xmalloc_pressure_stop(void) {
+    pthread_mutex_lock(&g_Pressure_Mutex);
+
+    if (g_Pressure_Running) {
+        __atomic_store_n(&g_Pressure_Stop, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &g_Pressure_Stop, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+        pthread_join(g_Pressure_Thread, 0);
+        g_Pressure_Running = 0;
+    }
+
+    pthread_mutex_unlock(&g_Pressure_Mutex);
+}
+
+
+
+// --------- HARDENED FREE FUNCTIONS --------------------------------
+
+
+
+// reports an invalid pointer passed to xfree (or xmalloc_usable_size
+// and xrealloc), a handler that returns means the call is ignored
+static __attribute__ ((cold, noinline)) void report_free_error(void* ptr, const char* error) {
+    xmalloc_error_handler handler = __atomic_load_n(&g_Error_Handler, __ATOMIC_ACQUIRE);
+
+    if (handler) {
+        handler(ptr, error);
+        return;
+    }
+
+    fprintf(stderr, "xfree error at %p, %s\n", ptr, error);
+    exit(1);
+}
+
+// gets the bucket a hardened xmalloc takes a slot of a bucket from,
+// slots under 16 bytes have no second word for the free key so a free
+// of a cached slot could not be told apart, they use 16 byte slots
+static inline int hardened_bucket(int bucket_i) {
+    return bucket_i < c_Free_Key_Bucket ? c_Free_Key_Bucket : bucket_i;
+}
+
+// checks a bucket pointer passed to a hardened xfree is the start of a
+// slot in use, a slot already freed is either free in the span bitmap
+// or holds the free key in its second word while it waits in a cache
+// (hardened xmallocs only use slots of 16 bytes or more), returns the
+// error or null if it is valid
+static inline const char* check_free(page_header* header, void* ptr) {
+    uint8_t bucket_i = header->bucket;
+    uint32_t size = c_Bucket_Sizes[bucket_i];
+    uint64_t offset = (uint64_t)ptr - (uint64_t)header;
+    uint64_t slot;
+
+    if (offset < c_Span_Data_Offset + header->color) {
+        return "pointer inside a span header";
+    }
+
+    // offsets are under 2^20 and sizes at most 2^13, so the reciprocal
+    // gives the exact quotient
+    offset -= c_Span_Data_Offset + header->color;
+    slot = (offset * g_Bucket_Reciprocals[bucket_i]) >> 40;
+    if (slot * size != offset) {
+        return "pointer not at the start of a slot";
+    }
+    if (slot >= g_Bucket_Slots[bucket_i]) {
+        return "pointer past the last slot of a span";
+    }
+    offset = slot;
+
+    // the bitmap may change under another thread's arena lock, but the
+    // bit of a slot this thread frees can only be cleared by its free,
+    // thread owned spans do not use their bitmap
+    if (!header->owned && !(__atomic_load_n(&header->bitmap[offset / 64], __ATOMIC_RELAXED) & (c_64_MSB_High >> (offset % 64)))) {
+        return "double free of a slot";
+    }
+    if (size >= 2 * sizeof(uint64_t) && ((uint64_t*)ptr)[1] == ((uint64_t)ptr ^ g_Free_Key)) {
+        return "double free of a cached slot";
+    }
+
+    return 0;
+}
+
+// sets the XMALLOC_HARDEN flags, free checks should be set before
+// anything is xmalloced since slots under 16 bytes xmalloced before
+// cannot be checked for double frees while cached
+void xmalloc_set_hardened(int flags) {
+    g_Hardened = (uint8_t)(flags & (XMALLOC_HARDEN_FREE | XMALLOC_HARDEN_RANDOM));
+}
+
+// sets the handler called with each invalid pointer passed to xfree,
+// it may log and abort or log and return to ignore the free, null
+// restores logging and exiting
+void xmalloc_set_error_handler(xmalloc_error_handler handler) {
+    __atomic_store_n(&g_Error_Handler, handler, __ATOMIC_RELEASE);
+}
+
+
+
+// --------- XMALLOC HEADER PROTOTYPE IMPLEMENTATIONS ---------------
+
+
+
+// gets the index of the smallest bucket that holds a given number of
+// bytes, at most BUCKET_MAX, there are two buckets per power of two so
+// the index comes from the top bit of bytes - 1 and the bit below it
+static inline int bucket_index(size_t bytes) {
+    if (bytes <= BUCKET_MIN) {
+        return 0;
+    }
+
+    uint64_t last = bytes - 1;
+    int top = 63 - __builtin_clzll(last);
+    return 2 * (top - 3) + 1 + (int)((last >> (top - 1)) & 0x1);
+}
+
+// gets the index of the smallest bucket that holds a given number of
+// bytes in slots alligned to a given power of two, or -1 if none does,
+// a slot of a power of two bucket is alligned to its size and any other
+// slot to the largest power of two dividing its size up to a cache
+// line, so the largest bucket holds any allignment up to
+// c_Bucket_Align_Max
+static inline int aligned_bucket_index(size_t alignment, size_t bytes) {
+    assert(alignment && !(alignment & (alignment - 1)));
+
+    if (bytes > BUCKET_MAX || alignment > c_Bucket_Align_Max) {
+        return -1;
+    }
+
+    int bucket_i = bucket_index(bytes);
+    while ((c_Bucket_Sizes[bucket_i] & (alignment - 1)) ||
+           (alignment > c_Color_Bytes && (c_Bucket_Sizes[bucket_i] & (c_Bucket_Sizes[bucket_i] - 1)))) {
+        bucket_i++;
+    }
+    return bucket_i;
+}
+
+// pushes a freed slot of a given bucket back into the cpu or thread
+// cache
+static inline void push_free(int bucket_i, void* ptr) {
+    if (percpu_usable()) {
+        percpu_cache_push(bucket_i, ptr);
+    }
+    else {
+        cache_push(bucket_i, ptr);
+    }
+}
+
+// frees a slot whose bucket the caller knows, skipping the page map
+// lookup, hardened frees still look it up and check the bucket matches
+static void free_bucket(int bucket_i, void* ptr) {
+    if (g_Hardened & XMALLOC_HARDEN_FREE) {
+        uint64_t entry = get_page_map(ptr);
+        if ((entry & c_Non_Bucket_Flag) || (entry && !(entry & c_Non_Bucket_Tail_Flag) && ((page_header*)entry)->bucket != hardened_bucket(bucket_i))) {
+            report_free_error(ptr, "size does not match the allocation");
+            return;
+        }
+
+        xfree(ptr);
+        return;
+    }
+
+    // thread owned spans are found through the page map
+    if (g_Owned) {
+        xfree(ptr);
+        return;
+    }
+
+    push_free(bucket_i, ptr);
+}
+
+// 'mallocs' a given number of bytes from a given bucket that holds
+// them, or a non bucket mmap past BUCKET_MAX
+static inline void* malloc_bucket(int bucket_i, size_t bytes) {
+    void* ptr;
+    int attempt;
+
+    if ((g_Hardened & XMALLOC_HARDEN_FREE) && bytes <= BUCKET_MAX) {
+        bucket_i = hardened_bucket(bucket_i);
+    }
+
+    // on failure purge free memory and try once more
+    for (attempt = 0; attempt < 2; attempt++) {
+        // if bytes is greater than the max bucket do regular mmap,
+        // otherwise pop a bucket from the thread's own span or the cpu
+        // or thread cache
+        if (bytes > BUCKET_MAX) {
+            ptr = mmap_non_bucket(bytes);
+        }
+        else if (g_Owned) {
+            ptr = owned_pop(bucket_i);
+        }
+        else {
+            ptr = percpu_usable() ? percpu_cache_pop(bucket_i) : cache_pop(bucket_i);
+        }
+
+        if (ptr) {
+            // clear the free key a hardened xfree left in the slot
+            if ((g_Hardened & XMALLOC_HARDEN_FREE) && bytes <= BUCKET_MAX && bucket_i >= c_Free_Key_Bucket) {
+                ((uint64_t*)ptr)[1] = 0;
+            }
+
+            // purge once the heap grows past the soft limit
+            if (soft_limit_exceeded()) {
+                xmalloc_purge();
+            }
+            return ptr;
+        }
+
+        xmalloc_purge();
+    }
+
+    errno = ENOMEM;
+    return 0;
+}
+
+// 'mallocs' a given number of bytes, returns null with errno set to
+// ENOMEM if the hard limit is reached or memory cannot be mmapped
+void* xmalloc(size_t bytes) {
+    int bucket_i = 0;
+
+    // determine bucket index from size
+    if (bytes <= BUCKET_MAX) {
+        bucket_i = bucket_index(bytes);
+        assert(bytes <= c_Bucket_Sizes[bucket_i] && (bucket_i == 0 ? 1 : bytes > c_Bucket_Sizes[bucket_i - 1]));
+    }
+
+    return malloc_bucket(bucket_i, bytes);
+}
+
+// 'frees' a given xmalloced pointer
+void xfree(void* ptr) {
+    // do nothing for null pointer
+    if (!ptr) {
+        return;
+    }
+
+    // get the page map entry
+    uint64_t entry = get_page_map(ptr);
+
+    // if non bucket return it to the large address space
+    if (entry & c_Non_Bucket_Flag) {
+        // only the start of the mmap may be freed
+        if ((uint64_t)ptr & (SPAN_UNIT - 1)) {
+            report_free_error(ptr, "pointer not at the start of a large mmap");
+            return;
+        }
+
+        munmap_non_bucket(ptr, entry & ~c_Non_Bucket_Flag);
+        return;
+    }
+
+    // check the pointer is owned by xmalloc and is not inside a non
+    // bucket mmap
+    if (!entry || (entry & c_Non_Bucket_Tail_Flag)) {
+        report_free_error(ptr, "pointer not owned");
+        return;
+    }
+
+    // validate the slot and mark it freed
+    if (g_Hardened & XMALLOC_HARDEN_FREE) {
+        const char* error = check_free((page_header*)entry, ptr);
+        if (error) {
+            report_free_error(ptr, error);
+            return;
+        }
+        if (((page_header*)entry)->bucket >= c_Free_Key_Bucket) {
+            ((uint64_t*)ptr)[1] = (uint64_t)ptr ^ g_Free_Key;
+        }
+    }
+
+    if (((page_header*)entry)->owned) {
+        owned_push((page_header*)entry, ptr);
+        return;
+    }
+
+    push_free(((page_header*)entry)->bucket, ptr);
+}
+
+// 'mallocs' a given number of bytes alligned to a given power of two
+// (at most SPAN_UNIT), returns null with errno set to EINVAL for any
+// other allignment
+void* xmalloc_aligned(size_t alignment, size_t bytes) {
+    if (!alignment || (alignment & (alignment - 1)) || alignment > SPAN_UNIT) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    // a bucket whose slots are alligned, otherwise a non bucket mmap
+    // which is alligned to a unit
+    int bucket_i = aligned_bucket_index(alignment, bytes);
+    if (bucket_i < 0) {
+        return malloc_bucket(0, bytes > BUCKET_MAX ? bytes : BUCKET_MAX + 1);
+    }
+
+    return malloc_bucket(bucket_i, c_Bucket_Sizes[bucket_i]);
+}
+
+// 'frees' a given pointer xmalloced with a given number of bytes
+void xfree_sized(void* ptr, size_t bytes) {
+    if (!ptr) {
+        return;
+    }
+
+    if (bytes > BUCKET_MAX) {
+        xfree(ptr);
+        return;
+    }
+
+    free_bucket(bucket_index(bytes), ptr);
+}
+
+// 'frees' a given pointer xmalloc_aligned with a given allignment and
+// number of bytes, an allignment xmalloc_aligned rejects is reported
+void xfree_aligned_sized(void* ptr, size_t alignment, size_t bytes) {
+    if (!ptr) {
+        return;
+    }
+
+    if (!alignment || (alignment & (alignment - 1)) || alignment > SPAN_UNIT) {
+        report_free_error(ptr, "invalid allignment");
+        return;
+    }
+
+    int bucket_i = aligned_bucket_index(alignment, bytes);
+    if (bucket_i < 0) {
+        xfree(ptr);
+        return;
+    }
+
+    free_bucket(bucket_i, ptr);
+}
+
+// gets the number of usable bytes of a given xmalloced pointer, 0 for a
+// pointer not owned once the error handler returns
+size_t xmalloc_usable_size(void* ptr) {
+    // a null pointer has no usable bytes
+    if (!ptr) {
+        return 0x00;
+    }
+
+    uint64_t entry = get_page_map(ptr);
+
+    // non buckets are the size of the mmap
+    if (entry & c_Non_Bucket_Flag) {
+        return entry & ~c_Non_Bucket_Flag;
+    }
+
+    // check the pointer is owned by xmalloc and is not inside a non
+    // bucket mmap
+    if (!entry || (entry & c_Non_Bucket_Tail_Flag)) {
+        report_free_error(ptr, "pointer not owned");
+        return 0x00;
+    }
+
+    return c_Bucket_Sizes[((page_header*)entry)->bucket];
+}
+
+// checks if a given pointer is owned by xmalloc, any pointer inside
+// the slots of a span or inside a non bucket mmap is owned, pointers
+// from other allocators are never owned
+int xmalloc_owns(const void* ptr) {
+    // nothing outside the reserved address space is owned while all
+    // memory lies inside it
+    if (g_Reserve_Only && !in_reserve(ptr)) {
+        return 0;
+    }
+
+    uint64_t entry = get_page_map(ptr);
+    uint64_t base = (uint64_t)ptr & ~(uint64_t)(SPAN_UNIT - 1);
+
+    // follow a non bucket tail unit back to the first unit of its mmap
+    if (entry & c_Non_Bucket_Tail_Flag) {
+        base = entry & ~c_Non_Bucket_Tail_Flag;
+        entry = get_page_map((void*)base);
+    }
+
+    // the last unit of a non bucket mmap past its size is not owned
+    if (entry & c_Non_Bucket_Flag) {
+        return (uint64_t)ptr - base < (entry & ~c_Non_Bucket_Flag);
+    }
+
+    // the span header itself is never returned to a caller
+    return entry && (uint64_t)ptr >= entry + c_Span_Data_Offset + ((page_header*)entry)->color;
+}
+
+// 'reallocs' the given pointer to new size, preserves data, returns
+// null and leaves the given pointer unchanged if xmalloc fails
+void* xrealloc(void* prev, size_t bytes) {
+    // do nothing with null pointer
+    if (!prev) {
+        return prev;
+    }
+    
+    void* ptr;
+    uint64_t entry = get_page_map(prev);
+    size_t prev_bytes = xmalloc_usable_size(prev);
+
+    // a pointer not owned was reported and is left alone
+    if (!prev_bytes) {
+        return 0;
+    }
+
+    // if non bucket flag
+    if (entry & c_Non_Bucket_Flag) {
+        // if new bytes is bigger than prev, or new bytes is less than
+        // 3/4 the previous size, resize in place if the space after it
+        // allows, otherwise create new pointer and move the old data
+        if (prev_bytes < bytes || bytes < (prev_bytes * 3 / 4)) {
+            if (bytes > BUCKET_MAX && bytes <= SIZE_MAX / 2 && resize_non_bucket(prev, prev_bytes, bytes)) {
+                return prev;
+            }
+
+            ptr = xmalloc(bytes);
+            if (!ptr) {
+                return 0;
+            }
+
+            // a big block grows by moving its pages rather than copying
+            if (prev_bytes >= c_Remap_Min && prev_bytes < bytes && remap_non_bucket(prev, ptr, prev_bytes)) {
+                xfree(prev);
+                return ptr;
+            }
+
+            copy_realloc(ptr, prev, bytes < prev_bytes ? bytes : prev_bytes);
+            xfree(prev);
+            return ptr;
+        }
+
+        // prev_bytes * 3/4 <= bytes <= prev_bytes
+        return prev;
+    }
+
+    // if new bytes does not fit in old (or any) bucket or fits in a
+    // smaller one, xmalloc new and copy data, so a sized free with the
+    // new bytes always finds the bucket of the slot
+    int bucket_i = bytes > BUCKET_MAX ? -1 : bucket_index(bytes);
+    if (bucket_i >= 0 && (g_Hardened & XMALLOC_HARDEN_FREE)) {
+        bucket_i = hardened_bucket(bucket_i);
+    }
+    if (bucket_i != ((page_header*)entry)->bucket) {
+        ptr = xmalloc(bytes);
+        if (!ptr) {
+            return 0;
+        }
+        memcpy(ptr, prev, bytes < prev_bytes ? bytes : prev_bytes);
+        xfree(prev);
+        return ptr;
+    }
+
+    // data fits, so return prev
+    return prev;
+}
+
+
+
+// --------- CONSTRUCTOR/DESTRUCTOR FUNCTIONS -----------------------
+
+
+
+// called when program starts, spans are mmapped on first use so the
+// heap limits apply to every span
+static void initialize_mutexes(void) {
+    // assert preprocessor definitions allign with constants
+    assert(c_Bucket_Sizes[0] == BUCKET_MIN && c_Bucket_Sizes[BUCKET_NUM - 1] == BUCKET_MAX);
+    
+    char* limit;
+
+    // the arena and transfer cache spin_mutexes start zeroed (unlocked),
+    // they only spin before parking if another cpu can release them
+    if (sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+        g_Spin_Checks = c_Spin_Checks;
+    }
+
+    // thread caches are flushed when their thread exits
+    pthread_key_create(&g_Cache_Key, flush_thread_caches);
+    __atomic_store_n(&g_Cache_Key_Ready, 0x1, __ATOMIC_RELEASE);
+
+    // use per cpu caches where rseq is available
+    initialize_percpu_caches();
+
+    // pick the non temporal copy for large xreallocs
+    initialize_stream_copy();
+
+    // read the heap limits in bytes from the environment
+    if ((limit = getenv("XMALLOC_SOFT_LIMIT"))) {
+        g_Soft_Limit = strtoull(limit, 0, 10);
+    }
+    if ((limit = getenv("XMALLOC_HARD_LIMIT"))) {
+        g_Hard_Limit = strtoull(limit, 0, 10);
+    }
+
+    for (int bucket_i = 0; bucket_i < BUCKET_NUM; bucket_i++) {
+        g_Bucket_Slots[bucket_i] = ((c_Span_Units[bucket_i] * SPAN_UNIT) - c_Span_Data_Offset) / c_Bucket_Sizes[bucket_i];
+        g_Bucket_Reciprocals[bucket_i] = (((uint64_t)0x1 << 40) + c_Bucket_Sizes[bucket_i] - 1) / c_Bucket_Sizes[bucket_i];
+        g_Bucket_Colors[bucket_i] = (c_Span_Units[bucket_i] * SPAN_UNIT - c_Span_Data_Offset - g_Bucket_Slots[bucket_i] * c_Bucket_Sizes[bucket_i]) / c_Color_Bytes + 1;
+
+        // power of two buckets past a cache line spend the space past
+        // their last slot on allignment instead, the slot count is the
+        // same since a span is a multiple of the bucket size
+        if (c_Bucket_Sizes[bucket_i] > c_Color_Bytes && !(c_Bucket_Sizes[bucket_i] & (c_Bucket_Sizes[bucket_i] - 1))) {
+            g_Bucket_Align_Colors[bucket_i] = (uint16_t)((g_Bucket_Colors[bucket_i] - 1) * c_Color_Bytes);
+            g_Bucket_Colors[bucket_i] = 1;
+            assert((c_Span_Data_Offset + g_Bucket_Align_Colors[bucket_i]) % c_Bucket_Sizes[bucket_i] == 0);
+        }
+    }
+
+    // hardened xfree checks, the free key only has to be unpredictable
+    // to the program so it falls back to the clock
+    if ((limit = getenv("XMALLOC_HARDENED"))) {
+        xmalloc_set_hardened((int)strtol(limit, 0, 10));
+    }
+    if (getrandom(&g_Free_Key, sizeof(g_Free_Key), GRND_NONBLOCK) != sizeof(g_Free_Key)) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        g_Free_Key = ((uint64_t)now.tv_nsec << 32) ^ (uint64_t)now.tv_sec ^ (uint64_t)&g_Free_Key;
     }
+
+    // reserve address space for chunks and large blocks if asked to
+    if ((limit = getenv("XMALLOC_RESERVE"))) {
+        reserve_address_space(strtoull(limit, 0, 10));
+    }
+
+    // use thread owned spans instead of the caches and arena stacks
+    if ((limit = getenv("XMALLOC_OWNED_SPANS")) && strtol(limit, 0, 10)) {
+        pthread_key_create(&g_Owned_Key, abandon_owned_spans);
+        g_Owned = 0x01;
+    }
+
+    // read the arena band in spans from the environment
+    if ((limit = getenv("XMALLOC_ARENA_BAND"))) {
+        g_Arena_Band = (uint32_t)strtoul(limit, 0, 10);
+    }
+}
+
+// called when program terminates, nothing is unmapped since the page
+// map and every cache still point into the chunks, and shared library
+// destructors that run after this one or detached threads may still
+// xmalloc and xfree, the operating system reclaims the heap at exit
+static void finalize_heap(void) {
+    xmalloc_pressure_stop();
 }
 
 
@@ -3,8 +3,43 @@
 
 #include <stddef.h>
 
+// the xmalloc_set_hardened flags, validate pointers passed to xfree and
+// pick free slots pseudo randomly
+#define XMALLOC_HARDEN_FREE   0x1
+#define XMALLOC_HARDEN_RANDOM 0x2
+
+// called with a pointer passed to xfree that xmalloc did not return or
+// that was already freed, and a description of the error
+typedef void (*xmalloc_error_handler)(void* ptr, const char* error);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 void* xmalloc(size_t bytes);
 void  xfree(void* ptr);
 void* xrealloc(void* prev, size_t bytes);
+size_t xmalloc_usable_size(void* ptr);
+int   xmalloc_owns(const void* ptr);
+
+void* xmalloc_aligned(size_t alignment, size_t bytes);
+void  xfree_sized(void* ptr, size_t bytes);
+void  xfree_aligned_sized(void* ptr, size_t alignment, size_t bytes);
+
+void   xmalloc_set_limits(size_t soft_bytes, size_t hard_bytes);
+size_t xmalloc_purge(void);
+size_t xmalloc_heap_bytes(void);
+size_t xmalloc_rebalance(void);
+
+int    xmalloc_pressure_poll(const char* cgroup_dir);
+int    xmalloc_pressure_start(const char* cgroup_dir, unsigned interval_ms);
+void   xmalloc_pressure_stop(void);
+
+void   xmalloc_set_hardened(int flags);
+void   xmalloc_set_error_handler(xmalloc_error_handler handler);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
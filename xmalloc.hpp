@@ -0,0 +1,95 @@
+#ifndef XMALLOC_HPP
+#define XMALLOC_HPP
+
+#include <cstddef>
+#include <limits>
+#include <new>
+#include <type_traits>
+
+#if __cplusplus >= 201703L
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define XMALLOC_MEMORY_RESOURCE 1
+#endif
+#endif
+
+#include "xmalloc.h"
+
+// a std::allocator compatible allocator over xmalloc, the element count
+// and allignment are passed back on deallocate so the slot is freed by
+// its size without a page map lookup
+template <class T>
+class xmalloc_allocator {
+public:
+    typedef T value_type;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type is_always_equal;
+
+    xmalloc_allocator() noexcept {}
+
+    template <class U>
+    xmalloc_allocator(const xmalloc_allocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n) {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+
+        void* ptr = xmalloc_aligned(alignof(T), n * sizeof(T));
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, std::size_t n) noexcept {
+        xfree_aligned_sized(ptr, alignof(T), n * sizeof(T));
+    }
+};
+
+template <class T, class U>
+bool operator==(const xmalloc_allocator<T>&, const xmalloc_allocator<U>&) noexcept {
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const xmalloc_allocator<T>&, const xmalloc_allocator<U>&) noexcept {
+    return false;
+}
+
+#ifdef XMALLOC_MEMORY_RESOURCE
+
+// a std::pmr::memory_resource over xmalloc, the size and allignment of
+// every allocation are passed back on deallocate like the allocator,
+// any two xmalloc resources are equal since they share one heap
+class xmalloc_memory_resource : public std::pmr::memory_resource {
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        void* ptr = xmalloc_aligned(alignment, bytes);
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    void do_deallocate(void* ptr, std::size_t bytes, std::size_t alignment) override {
+        xfree_aligned_sized(ptr, alignment, bytes);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other || dynamic_cast<const xmalloc_memory_resource*>(&other) != nullptr;
+    }
+};
+
+// gets the process wide xmalloc memory resource, for example to pass to
+// std::pmr::set_default_resource
+inline xmalloc_memory_resource* xmalloc_resource() noexcept {
+    static xmalloc_memory_resource resource;
+    return &resource;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,175 @@
+// replaces every global operator new and delete with xmalloc, link it
+// into a C++ program along with xmalloc.c
+// plain new uses the bucket of its size, aligned new the smallest
+// bucket whose slots have the allignment, sized deletes pass the size
+// (and allignment) back so the bucket is known without the page map
+
+#include <cerrno>
+#include <cstddef>
+#include <new>
+
+#include "xmalloc.h"
+
+
+
+// --------- ALLOCATION FUNCTIONS -----------------------------------
+
+
+
+// 'mallocs' for new, calls the new handler until xmalloc succeeds and
+// throws bad_alloc when there is none
+static void* new_bytes(std::size_t bytes) {
+    for (;;) {
+        void* ptr = xmalloc(bytes);
+        if (ptr) {
+            return ptr;
+        }
+
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+#if __cpp_aligned_new
+
+// 'mallocs' for aligned new, an allignment xmalloc_aligned does not
+// support fails at once since no handler can make it succeed
+static void* new_aligned_bytes(std::size_t bytes, std::align_val_t alignment) {
+    for (;;) {
+        void* ptr = xmalloc_aligned(static_cast<std::size_t>(alignment), bytes);
+        if (ptr) {
+            return ptr;
+        }
+
+        std::new_handler handler = std::get_new_handler();
+        if (!handler || errno == EINVAL) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+#endif
+
+
+
+// --------- OPERATOR NEW -------------------------------------------
+
+
+
+void* operator new(std::size_t bytes) {
+    return new_bytes(bytes);
+}
+
+void* operator new[](std::size_t bytes) {
+    return new_bytes(bytes);
+}
+
+void* operator new(std::size_t bytes, const std::nothrow_t&) noexcept {
+    try {
+        return new_bytes(bytes);
+    }
+    catch (...) {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t bytes, const std::nothrow_t&) noexcept {
+    try {
+        return new_bytes(bytes);
+    }
+    catch (...) {
+        return nullptr;
+    }
+}
+
+#if __cpp_aligned_new
+
+void* operator new(std::size_t bytes, std::align_val_t alignment) {
+    return new_aligned_bytes(bytes, alignment);
+}
+
+void* operator new[](std::size_t bytes, std::align_val_t alignment) {
+    return new_aligned_bytes(bytes, alignment);
+}
+
+void* operator new(std::size_t bytes, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    try {
+        return new_aligned_bytes(bytes, alignment);
+    }
+    catch (...) {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t bytes, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    try {
+        return new_aligned_bytes(bytes, alignment);
+    }
+    catch (...) {
+        return nullptr;
+    }
+}
+
+#endif
+
+
+
+// --------- OPERATOR DELETE ----------------------------------------
+
+
+
+void operator delete(void* ptr) noexcept {
+    xfree(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    xfree(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    xfree(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    xfree(ptr);
+}
+
+void operator delete(void* ptr, std::size_t bytes) noexcept {
+    xfree_sized(ptr, bytes);
+}
+
+void operator delete[](void* ptr, std::size_t bytes) noexcept {
+    xfree_sized(ptr, bytes);
+}
+
+#if __cpp_aligned_new
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    xfree(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    xfree(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    xfree(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    xfree(ptr);
+}
+
+void operator delete(void* ptr, std::size_t bytes, std::align_val_t alignment) noexcept {
+    xfree_aligned_sized(ptr, static_cast<std::size_t>(alignment), bytes);
+}
+
+void operator delete[](void* ptr, std::size_t bytes, std::align_val_t alignment) noexcept {
+    xfree_aligned_sized(ptr, static_cast<std::size_t>(alignment), bytes);
+}
+
+#endif